@@ -1,109 +1,583 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define JPG_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// functions using instructions beyond the compiler's target must say so
+//   on GCC and Clang, MSVC accepts any intrinsic
+#if defined(JPG_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "jpg.h"
 
-// helper class to read bits from a file
-class BitReader {
+// read-only memory mapping of a whole file
+class MappedFile {
 private:
-    byte nextByte = 0;
-    byte nextBit = 0;
-    std::ifstream inFile;
+    const byte* data = nullptr;
+    size_t size = 0;
+    bool open = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
 
 public:
-    BitReader(const std::string& filename) {
-        inFile.open(filename, std::ios::in | std::ios::binary);
+    MappedFile(const std::string& filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            return;
+        }
+        size = (size_t)fileSize.QuadPart;
+        if (size == 0) {
+            open = true;
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            return;
+        }
+        data = (const byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        open = data != nullptr;
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+            close(fd);
+            return;
+        }
+        size = (size_t)fileStat.st_size;
+        if (size == 0) {
+            close(fd);
+            open = true;
+            return;
+        }
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const byte*)mapped;
+        open = true;
+#endif
     }
 
-    ~BitReader() {
-        if (inFile.is_open()) {
-            inFile.close();
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (data != nullptr) {
+            munmap((void*)data, size);
         }
+#endif
     }
 
-    bool hasBits() {
-        return !!inFile;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const {
+        return open;
     }
 
-    byte readByte() {
-        nextBit = 0;
-        return inFile.get();
+    const byte* getData() const {
+        return data;
     }
 
-    uint32_t readWord() {
-        nextBit = 0;
-        return (inFile.get() << 8) + inFile.get();
+    size_t getSize() const {
+        return size;
     }
+};
 
-    // read one bit (0 or 1) or return -1 if all bits have already been read
-    uint32_t readBit() {
-        if (nextBit == 0) {
-            if (!hasBits()) {
-                return -1;
-            }
-            nextByte = inFile.get();
-            while (nextByte == 0xFF) {
-                if (!hasBits()) {
-                    return -1;
-                }
-                byte marker = inFile.peek();
+// helper class to read bits from an in-memory JPG
+//   entropy-coded data is consumed through a 64-bit bit buffer
+//   the data is not copied and must outlive the BitReader
+class BitReader {
+private:
+    const byte* data = nullptr;
+    size_t size = 0;
+    size_t position = 0;
+    // set once a byte past the end of the data has been requested
+    bool pastEnd = false;
+
+    // bits loaded from the data but not yet consumed
+    //   the next bit to consume is the most significant bit of bitBuffer
+    //   and every bit below the bitCount loaded bits is 0
+    uint64_t bitBuffer = 0;
+    uint32_t bitCount = 0;
+    // set when a marker other than RSTN ends the entropy-coded data
+    bool markerReached = false;
+
+    // load whole bytes of entropy-coded data into the bit buffer until
+    //   it holds more than 56 bits or the end of the data is reached
+    void fillBits() {
+        // fast path: the next 8 bytes contain no 0xFF, so as many of them
+        //   as fit can be loaded without unstuffing or marker checks
+        if (position + 8 <= size && !markerReached) {
+            uint64_t word = 0;
+            for (uint32_t i = 0; i < 8; ++i) {
+                word = (word << 8) | data[position + i];
+            }
+            // a byte is 0xFF exactly when the same byte of ~word is 0
+            const uint64_t inverted = ~word;
+            const bool hasFF = ((inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull) != 0;
+            if (!hasFF) {
+                const uint32_t numBytes = (63 - bitCount) / 8;
+                word &= ~(~0ull >> (numBytes * 8));
+                bitBuffer |= word >> bitCount;
+                bitCount += numBytes * 8;
+                position += numBytes;
+                return;
+            }
+        }
+
+        while (bitCount <= 56 && !markerReached) {
+            if (position >= size) {
+                markerReached = true;
+                return;
+            }
+            byte current = data[position++];
+            if (current == 0xFF) {
                 // ignore multiple 0xFF's in a row
-                while (marker == 0xFF) {
-                    inFile.get();
-                    if (!hasBits()) {
-                        return -1;
-                    }
-                    marker = inFile.peek();
+                while (position < size && data[position] == 0xFF) {
+                    position += 1;
                 }
+                const byte marker = position < size ? data[position] : 0xFF;
                 // literal 0xFF's are encoded in the bitstream as 0xFF00
                 if (marker == 0x00) {
-                    inFile.get();
-                    break;
+                    position += 1;
                 }
                 // restart marker
                 else if (marker >= RST0 && marker <= RST7) {
-                    inFile.get();
-                    nextByte = inFile.get();
+                    position += 1;
+                    continue;
                 }
+                // any other marker ends the data, leave it to be read as bytes
                 else {
-                    std::cout << "Error - Invalid marker: 0x" << std::hex << (uint32_t)marker << std::dec << '\n';
-                    return -1;
+                    position -= 1;
+                    markerReached = true;
+                    return;
                 }
             }
+            bitBuffer |= (uint64_t)current << (56 - bitCount);
+            bitCount += 8;
+        }
+    }
+
+    // discard the bit buffer before going back to reading whole bytes
+    void resetBits() {
+        bitBuffer = 0;
+        bitCount = 0;
+        markerReached = false;
+    }
+
+public:
+    BitReader(const byte* const d, const size_t s) :
+        data(d),
+        size(s)
+    {
+    }
+
+    bool hasBits() {
+        return !pastEnd;
+    }
+
+    byte readByte() {
+        resetBits();
+        if (position >= size) {
+            pastEnd = true;
+            return 0;
+        }
+        return data[position++];
+    }
+
+    uint32_t readWord() {
+        const uint32_t high = readByte();
+        return (high << 8) + readByte();
+    }
+
+    // return the next length bits (1 to 32) without consuming them
+    //   bits past the end of the entropy-coded data are read as 0
+    uint32_t peekBits(const uint32_t length) {
+        if (bitCount < length) {
+            fillBits();
+        }
+        return (uint32_t)(bitBuffer >> (64 - length));
+    }
+
+    // consume length bits that have already been peeked
+    // return false if fewer than length bits were left
+    bool consumeBits(const uint32_t length) {
+        if (bitCount < length) {
+            bitBuffer = 0;
+            bitCount = 0;
+            return false;
         }
-        uint32_t bit = (nextByte >> (7 - nextBit)) & 1;
-        nextBit = (nextBit + 1) % 8;
-        return bit;
+        bitBuffer <<= length;
+        bitCount -= length;
+        return true;
+    }
+
+    // read one bit (0 or 1) or return -1 if all bits have already been read
+    uint32_t readBit() {
+        return readBits(1);
     }
 
-    // read a variable number of bits
+    // read a variable number of bits (at most 32)
     // first read bit is most significant bit
     // return -1 if at any point all bits have already been read
     uint32_t readBits(const uint32_t length) {
-        uint32_t bits = 0;
-        for (uint32_t i = 0; i < length; ++i) {
-            uint32_t bit = readBit();
-            if (bit == -1) {
-                bits = -1;
-                break;
-            }
-            bits = (bits << 1) | bit;
+        if (length == 0) {
+            return 0;
+        }
+        const uint32_t bits = peekBits(length);
+        if (!consumeBits(length)) {
+            return -1;
         }
         return bits;
     }
 
     // advance to the 0th bit of the next byte
     void align() {
-        nextBit = 0;
+        consumeBits(bitCount % 8);
+    }
+
+    const byte* getData() const {
+        return data;
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+
+    // position of the next byte that has not been loaded into the bit buffer
+    size_t getPosition() const {
+        return position;
+    }
+
+    // continue reading whole bytes from position
+    void seek(const size_t p) {
+        resetBits();
+        position = p;
+    }
+};
+
+// fixed set of worker threads that share the iterations of parallel loops
+//   with the thread that starts them
+// only one thread may use a pool at a time, and tasks must not use it
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(uint32_t)>* task = nullptr;
+    uint32_t taskCount = 0;
+    std::atomic<uint32_t> nextIndex{ 0 };
+    uint32_t busyWorkers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    // claim and run iterations of the current loop until none are left
+    void runTasks() {
+        for (uint32_t i = nextIndex++; i < taskCount; i = nextIndex++) {
+            (*task)(i);
+        }
+    }
+
+    void workerLoop() {
+        uint64_t seenGeneration = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping) {
+                    return;
+                }
+                seenGeneration = generation;
+            }
+            runTasks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busyWorkers -= 1;
+                if (busyWorkers == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+    }
+
+public:
+    // numThreads counts the calling thread, so a pool of 1 runs everything inline
+    ThreadPool(const uint32_t numThreads) {
+        for (uint32_t i = 1; i < numThreads; ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    uint32_t getNumThreads() const {
+        return (uint32_t)workers.size() + 1;
+    }
+
+    // call function(i) for every i in [0, count) and return once all calls are done
+    template <typename Function>
+    void parallelFor(const uint32_t count, const Function& function) {
+        if (workers.empty() || count <= 1) {
+            for (uint32_t i = 0; i < count; ++i) {
+                function(i);
+            }
+            return;
+        }
+        // a std::function holding a reference never allocates, unlike one
+        //   holding a copy of a lambda with several captures
+        const std::function<void(uint32_t)> wrapper(std::cref(function));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &wrapper;
+            taskCount = count;
+            nextIndex = 0;
+            busyWorkers = (uint32_t)workers.size();
+            generation += 1;
+        }
+        wake.notify_all();
+        runTasks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return busyWorkers == 0; });
+        task = nullptr;
+    }
+};
+
+// call function(mcuRow) for every MCU row in [0, mcuRows), with the rows
+//   split into bands of consecutive rows that are shared out on threadPool
+template <typename Function>
+void parallelForMCURows(const uint32_t mcuRows, ThreadPool* const threadPool, const Function& function) {
+    if (threadPool == nullptr) {
+        for (uint32_t mcuRow = 0; mcuRow < mcuRows; ++mcuRow) {
+            function(mcuRow);
+        }
+        return;
+    }
+    // a few bands per thread even out the load without
+    //   scheduling every row separately
+    const uint32_t numBands = std::min(mcuRows, threadPool->getNumThreads() * 4);
+    threadPool->parallelFor(numBands, [&](const uint32_t band) {
+        const uint32_t firstRow = (uint32_t)((uint64_t)mcuRows * band / numBands);
+        const uint32_t lastRow = (uint32_t)((uint64_t)mcuRows * (band + 1) / numBands);
+        for (uint32_t mcuRow = firstRow; mcuRow < lastRow; ++mcuRow) {
+            function(mcuRow);
+        }
+    });
+}
+
+// hands out buffers from one block of memory that is kept from one image
+//   to the next and only grows when an image needs more than it holds,
+//   so that decoding similar images allocates nothing
+class Arena {
+private:
+    byte* memory = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    // buffers that did not fit in memory, freed by the next reset
+    std::vector<byte*> overflow;
+    size_t overflowSize = 0;
+
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        reset();
+        delete[] memory;
+    }
+
+    // return an uninitialized buffer of size bytes, or nullptr if out of memory
+    byte* allocate(size_t size) {
+        // keep the buffers 16-byte aligned, as new does
+        size = (size + 15) & ~(size_t)15;
+        if (used + size <= capacity) {
+            byte* const buffer = memory + used;
+            used += size;
+            return buffer;
+        }
+        byte* const buffer = new (std::nothrow) byte[size];
+        if (buffer != nullptr) {
+            overflow.push_back(buffer);
+            overflowSize += size;
+        }
+        return buffer;
+    }
+
+    // free all buffers at once, growing memory to hold everything handed
+    //   out since the last reset
+    void reset() {
+        for (byte* const buffer : overflow) {
+            delete[] buffer;
+        }
+        overflow.clear();
+        if (overflowSize != 0) {
+            delete[] memory;
+            capacity = used + overflowSize;
+            memory = new (std::nothrow) byte[capacity];
+            if (memory == nullptr) {
+                capacity = 0;
+            }
+        }
+        used = 0;
+        overflowSize = 0;
+    }
+};
+
+// allocate count uninitialized elements for one of image's buffers, from
+//   its arena if it has one
+template <typename T>
+T* allocateBuffer(JPGImage* const image, const size_t count) {
+    if (image->arena != nullptr) {
+        return (T*)image->arena->allocate(count * sizeof(T));
+    }
+    return new (std::nothrow) T[count];
+}
+
+// receives the decoder's messages, each without its final line break,
+//   possibly from several threads at once
+class LogSink {
+public:
+    virtual ~LogSink() {}
+
+    virtual void write(const LogLevel level, const std::string& message) = 0;
+};
+
+// writes the messages to a stream, one whole message at a time
+class StreamLogSink : public LogSink {
+private:
+    std::ostream& stream;
+    std::mutex mutex;
+
+public:
+    StreamLogSink(std::ostream& s) :
+        stream(s)
+    {
+    }
+
+    void write(const LogLevel, const std::string& message) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream << message << '\n';
     }
 };
 
+StreamLogSink coutLogSink(std::cout);
+LogSink* logSink = &coutLogSink;
+// messages above logLevel are dropped before they are formatted
+LogLevel logLevel = LogLevel::Debug;
+
+// format the arguments into one message for the sink, if level is enabled
+template <typename... Args>
+void logMessage(const LogLevel level, const Args&... args) {
+    if (level > logLevel) {
+        return;
+    }
+    std::ostringstream message;
+    (message << ... << args);
+    logSink->write(level, message.str());
+}
+
+// mark the image invalid, keeping the first error that made it invalid,
+//   and report why
+template <typename... Args>
+void setError(JPGImage* const image, const DecodeError error, const Args&... args) {
+    if (image->error == DecodeError::None || image->error == DecodeError::CorruptData) {
+        image->error = error;
+    }
+    image->isValid = false;
+    logMessage(LogLevel::Error, "Error - ", args...);
+}
+
+const char* getErrorName(const DecodeError error) {
+    switch (error) {
+    case DecodeError::None: return "no error";
+    case DecodeError::OpenFailed: return "file could not be opened";
+    case DecodeError::OutOfMemory: return "out of memory";
+    case DecodeError::InvalidOption: return "invalid option";
+    case DecodeError::InvalidMarker: return "invalid marker";
+    case DecodeError::Unsupported: return "unsupported feature";
+    case DecodeError::TruncatedFile: return "file ended prematurely";
+    case DecodeError::CorruptData: return "corrupt Huffman data";
+    case DecodeError::WriteFailed: return "output could not be written";
+    }
+    return "unknown error";
+}
+
 // SOF specifies frame type, dimensions, and number of color components
 void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOF Marker\n";
+    logMessage(LogLevel::Info, "Reading SOF Marker");
     if (image->numComponents != 0) {
-        std::cout << "Error - Multiple SOFs detected\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "Multiple SOFs detected");
         return;
     }
 
@@ -111,16 +585,14 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
     byte precision = bitReader.readByte();
     if (precision != 8) {
-        std::cout << "Error - Invalid precision: " << (uint32_t)precision << '\n';
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "Invalid precision: ", (uint32_t)precision);
         return;
     }
 
     image->height = bitReader.readWord();
     image->width = bitReader.readWord();
     if (image->height == 0 || image->width == 0) {
-        std::cout << "Error - Invalid dimensions\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "Invalid dimensions");
         return;
     }
     image->blockHeight = (image->height + 7) / 8;
@@ -130,13 +602,11 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
     image->numComponents = bitReader.readByte();
     if (image->numComponents == 4) {
-        std::cout << "Error - CMYK color mode not supported\n";
-        image->isValid = false;
+        setError(image, DecodeError::Unsupported, "CMYK color mode not supported");
         return;
     }
     if (image->numComponents != 1 && image->numComponents != 3) {
-        std::cout << "Error - " << (uint32_t)image->numComponents << " color components given (1 or 3 required)\n";
-        image->isValid = false;
+        setError(image, DecodeError::Unsupported, (uint32_t)image->numComponents, " color components given (1 or 3 required)");
         return;
     }
     for (uint32_t i = 0; i < image->numComponents; ++i) {
@@ -150,14 +620,12 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
             componentID += 1;
         }
         if (componentID == 0 || componentID > image->numComponents) {
-            std::cout << "Error - Invalid component ID: " << (uint32_t)componentID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid component ID: ", (uint32_t)componentID);
             return;
         }
         ColorComponent& component = image->colorComponents[componentID - 1];
         if (component.usedInFrame) {
-            std::cout << "Error - Duplicate color component ID: " << (uint32_t)componentID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Duplicate color component ID: ", (uint32_t)componentID);
             return;
         }
         component.usedInFrame = true;
@@ -168,8 +636,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
         if (componentID == 1) {
             if ((component.horizontalSamplingFactor != 1 && component.horizontalSamplingFactor != 2) ||
                 (component.verticalSamplingFactor != 1 && component.verticalSamplingFactor != 2)) {
-                std::cout << "Error - Sampling factors not supported\n";
-                image->isValid = false;
+                setError(image, DecodeError::Unsupported, "Sampling factors not supported");
                 return;
             }
             if (component.horizontalSamplingFactor == 2 && image->blockWidth % 2 == 1) {
@@ -183,30 +650,42 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
         }
         else {
             if (component.horizontalSamplingFactor != 1 || component.verticalSamplingFactor != 1) {
-                std::cout << "Error - Sampling factors not supported\n";
-                image->isValid = false;
+                setError(image, DecodeError::Unsupported, "Sampling factors not supported");
                 return;
             }
         }
 
         component.quantizationTableID = bitReader.readByte();
         if (component.quantizationTableID > 3) {
-            std::cout << "Error - Invalid quantization table ID: " << (uint32_t)component.quantizationTableID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid quantization table ID: ", (uint32_t)component.quantizationTableID);
             return;
         }
     }
 
     if (length - 8 - (3 * image->numComponents) != 0) {
-        std::cout << "Error - SOF invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "SOF invalid");
         return;
     }
 }
 
+// pre-multiply a quantization table by the scale factors that the
+//   IDCT applies to each row and column, so that dequantization
+//   costs a single multiply inside the IDCT
+// the integer IDCT needs no scale factors, it gets the table as 16-bit
+//   values so that SIMD kernels can multiply 8 coefficients at once
+void scaleQuantizationTable(QuantizationTable& qTable) {
+    const double scales[8] = { s0, s1, s2, s3, s4, s5, s6, s7 };
+    for (uint32_t y = 0; y < 8; ++y) {
+        for (uint32_t x = 0; x < 8; ++x) {
+            qTable.scaledTable[y * 8 + x] = (float)(qTable.table[y * 8 + x] * scales[y] * scales[x]);
+            qTable.integerTable[y * 8 + x] = (int16_t)std::min(qTable.table[y * 8 + x], 32767u);
+        }
+    }
+}
+
 // DQT contains one or more quantization tables
 void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DQT Marker\n";
+    logMessage(LogLevel::Info, "Reading DQT Marker");
     int length = bitReader.readWord();
     length -= 2;
 
@@ -216,8 +695,7 @@ void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
         byte tableID = tableInfo & 0x0F;
 
         if (tableID > 3) {
-            std::cout << "Error - Invalid quantization table ID: " << (uint32_t)tableID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid quantization table ID: ", (uint32_t)tableID);
             return;
         }
         QuantizationTable& qTable = image->quantizationTables[tableID];
@@ -235,11 +713,11 @@ void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
             }
             length -= 64;
         }
+        scaleQuantizationTable(qTable);
     }
 
     if (length != 0) {
-        std::cout << "Error - DQT invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "DQT invalid");
         return;
     }
 }
@@ -254,11 +732,30 @@ void generateCodes(HuffmanTable& hTable) {
         }
         code <<= 1;
     }
+
+    // every huffmanLookupBits-bit value that begins with a code of at most
+    //   huffmanLookupBits bits maps to that code's symbol and length
+    std::fill(hTable.lookupLengths, hTable.lookupLengths + (1 << huffmanLookupBits), 0);
+    for (uint32_t i = 0; i < huffmanLookupBits; ++i) {
+        const uint32_t codeLength = i + 1;
+        const uint32_t spare = huffmanLookupBits - codeLength;
+        for (uint32_t j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            // an over-full table produces codes that no longer fit their length
+            if (hTable.codes[j] >> codeLength != 0) {
+                break;
+            }
+            const uint32_t first = hTable.codes[j] << spare;
+            for (uint32_t k = 0; k < (1u << spare); ++k) {
+                hTable.lookupSymbols[first + k] = hTable.symbols[j];
+                hTable.lookupLengths[first + k] = codeLength;
+            }
+        }
+    }
 }
 
 // DHT contains one or more Huffman tables
 void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DHT Marker\n";
+    logMessage(LogLevel::Info, "Reading DHT Marker");
     int length = bitReader.readWord();
     length -= 2;
 
@@ -268,8 +765,7 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
         bool acTable = tableInfo >> 4;
 
         if (tableID > 3) {
-            std::cout << "Error - Invalid Huffman table ID: " << (uint32_t)tableID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid Huffman table ID: ", (uint32_t)tableID);
             return;
         }
 
@@ -285,8 +781,7 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
             hTable.offsets[i] = allSymbols;
         }
         if (allSymbols > 176) {
-            std::cout << "Error - Too many symbols in Huffman table: " << allSymbols << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Too many symbols in Huffman table: ", allSymbols);
             return;
         }
 
@@ -300,18 +795,16 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
     }
 
     if (length != 0) {
-        std::cout << "Error - DHT invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "DHT invalid");
         return;
     }
 }
 
 // SOS contains color component info for the next scan
 void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOS Marker\n";
+    logMessage(LogLevel::Info, "Reading SOS Marker");
     if (image->numComponents == 0) {
-        std::cout << "Error - SOS detected before SOF\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "SOS detected before SOF");
         return;
     }
 
@@ -325,8 +818,7 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     //   components in the image
     image->componentsInScan = bitReader.readByte();
     if (image->componentsInScan == 0) {
-        std::cout << "Error - Scan must include at least 1 component\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "Scan must include at least 1 component");
         return;
     }
     for (uint32_t i = 0; i < image->componentsInScan; ++i) {
@@ -336,19 +828,16 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
             componentID += 1;
         }
         if (componentID == 0 || componentID > image->numComponents) {
-            std::cout << "Error - Invalid color component ID: " << (uint32_t)componentID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid color component ID: ", (uint32_t)componentID);
             return;
         }
         ColorComponent& component = image->colorComponents[componentID - 1];
         if (!component.usedInFrame) {
-            std::cout << "Error - Invalid color component ID: " << (uint32_t)componentID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid color component ID: ", (uint32_t)componentID);
             return;
         }
         if (component.usedInScan) {
-            std::cout << "Error - Duplicate color component ID: " << (uint32_t)componentID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Duplicate color component ID: ", (uint32_t)componentID);
             return;
         }
         component.usedInScan = true;
@@ -357,13 +846,11 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
         component.huffmanDCTableID = huffmanTableIDs >> 4;
         component.huffmanACTableID = huffmanTableIDs & 0x0F;
         if (component.huffmanDCTableID > 3) {
-            std::cout << "Error - Invalid Huffman DC table ID: " << (uint32_t)component.huffmanDCTableID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid Huffman DC table ID: ", (uint32_t)component.huffmanDCTableID);
             return;
         }
         if (component.huffmanACTableID > 3) {
-            std::cout << "Error - Invalid Huffman AC table ID: " << (uint32_t)component.huffmanACTableID << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid Huffman AC table ID: ", (uint32_t)component.huffmanACTableID);
             return;
         }
     }
@@ -377,41 +864,34 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     if (image->frameType == SOF0) {
         // Baseline JPGs don't use spectral selection or successive approximtion
         if (image->startOfSelection != 0 || image->endOfSelection != 63) {
-            std::cout << "Error - Invalid spectral selection\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid spectral selection");
             return;
         }
         if (image->successiveApproximationHigh != 0 || image->successiveApproximationLow != 0) {
-            std::cout << "Error - Invalid successive approximation\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid successive approximation");
             return;
         }
     }
     else if (image->frameType == SOF2) {
         if (image->startOfSelection > image->endOfSelection) {
-            std::cout << "Error - Invalid spectral selection (start greater than end)\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid spectral selection (start greater than end)");
             return;
         }
         if (image->endOfSelection > 63) {
-            std::cout << "Error - Invalid spectral selection (end greater than 63)\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid spectral selection (end greater than 63)");
             return;
         }
         if (image->startOfSelection == 0 && image->endOfSelection != 0) {
-            std::cout << "Error - Invalid spectral selection (contains DC and AC)\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid spectral selection (contains DC and AC)");
             return;
         }
         if (image->startOfSelection != 0 && image->componentsInScan != 1) {
-            std::cout << "Error - Invalid spectral selection (AC scan contains multiple components)\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid spectral selection (AC scan contains multiple components)");
             return;
         }
         if (image->successiveApproximationHigh != 0 &&
             image->successiveApproximationLow != image->successiveApproximationHigh - 1) {
-            std::cout << "Error - Invalid successive approximation\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid successive approximation");
             return;
         }
     }
@@ -420,21 +900,18 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
         const ColorComponent& component = image->colorComponents[i];
         if (image->colorComponents[i].usedInScan) {
             if (image->quantizationTables[component.quantizationTableID].set == false) {
-                std::cout << "Error - Color component using uninitialized quantization table\n";
-                image->isValid = false;
+                setError(image, DecodeError::InvalidMarker, "Color component using uninitialized quantization table");
                 return;
             }
             if (image->startOfSelection == 0) {
                 if (image->huffmanDCTables[component.huffmanDCTableID].set == false) {
-                    std::cout << "Error - Color component using uninitialized Huffman DC table\n";
-                    image->isValid = false;
+                    setError(image, DecodeError::InvalidMarker, "Color component using uninitialized Huffman DC table");
                     return;
                 }
             }
             if (image->endOfSelection > 0) {
                 if (image->huffmanACTables[component.huffmanACTableID].set == false) {
-                    std::cout << "Error - Color component using uninitialized Huffman AC table\n";
-                    image->isValid = false;
+                    setError(image, DecodeError::InvalidMarker, "Color component using uninitialized Huffman AC table");
                     return;
                 }
             }
@@ -442,32 +919,29 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     }
 
     if (length - 6 - (2 * image->componentsInScan) != 0) {
-        std::cout << "Error - SOS invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "SOS invalid");
         return;
     }
 }
 
 // restart interval is needed to stay synchronized during data scans
 void readRestartInterval(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DRI Marker\n";
+    logMessage(LogLevel::Info, "Reading DRI Marker");
     uint32_t length = bitReader.readWord();
 
     image->restartInterval = bitReader.readWord();
     if (length - 4 != 0) {
-        std::cout << "Error - DRI invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "DRI invalid");
         return;
     }
 }
 
 // APPNs simply get skipped based on length
 void readAPPN(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading APPN Marker\n";
+    logMessage(LogLevel::Info, "Reading APPN Marker");
     uint32_t length = bitReader.readWord();
     if (length < 2) {
-        std::cout << "Error - APPN invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "APPN invalid");
         return;
     }
 
@@ -478,11 +952,10 @@ void readAPPN(BitReader& bitReader, JPGImage* const image) {
 
 // comments simply get skipped based on length
 void readComment(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading COM Marker\n";
+    logMessage(LogLevel::Info, "Reading COM Marker");
     uint32_t length = bitReader.readWord();
     if (length < 2) {
-        std::cout << "Error - COM invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "COM invalid");
         return;
     }
 
@@ -491,85 +964,91 @@ void readComment(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-// print all info extracted from the JPG file
+// print all info extracted from the JPG file, at the Debug log level
 void printFrameInfo(const JPGImage* const image) {
-    if (image == nullptr) return;
-    std::cout << "SOF=============\n";
-    std::cout << "Frame Type: 0x" << std::hex << (uint32_t)image->frameType << std::dec << '\n';
-    std::cout << "Height: " << image->height << '\n';
-    std::cout << "Width: " << image->width << '\n';
-    std::cout << "Color Components:\n";
+    if (image == nullptr || logLevel < LogLevel::Debug) return;
+    std::ostringstream info;
+    info << "SOF=============\n";
+    info << "Frame Type: 0x" << std::hex << (uint32_t)image->frameType << std::dec << '\n';
+    info << "Height: " << image->height << '\n';
+    info << "Width: " << image->width << '\n';
+    info << "Color Components:\n";
     for (uint32_t i = 0; i < image->numComponents; ++i) {
         if (image->colorComponents[i].usedInFrame) {
-            std::cout << "Component ID: " << (i + 1) << '\n';
-            std::cout << "Horizontal Sampling Factor: " << (uint32_t)image->colorComponents[i].horizontalSamplingFactor << '\n';
-            std::cout << "Vertical Sampling Factor: " << (uint32_t)image->colorComponents[i].verticalSamplingFactor << '\n';
-            std::cout << "Quantization Table ID: " << (uint32_t)image->colorComponents[i].quantizationTableID << '\n';
+            info << "Component ID: " << (i + 1) << '\n';
+            info << "Horizontal Sampling Factor: " << (uint32_t)image->colorComponents[i].horizontalSamplingFactor << '\n';
+            info << "Vertical Sampling Factor: " << (uint32_t)image->colorComponents[i].verticalSamplingFactor << '\n';
+            info << "Quantization Table ID: " << (uint32_t)image->colorComponents[i].quantizationTableID << '\n';
         }
     }
-    std::cout << "DQT=============\n";
+    info << "DQT=============\n";
     for (uint32_t i = 0; i < 4; ++i) {
         if (image->quantizationTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Table Data:";
+            info << "Table ID: " << i << '\n';
+            info << "Table Data:";
             for (uint32_t j = 0; j < 64; ++j) {
                 if (j % 8 == 0) {
-                    std::cout << '\n';
+                    info << '\n';
                 }
-                std::cout << image->quantizationTables[i].table[j] << ' ';
+                info << image->quantizationTables[i].table[j] << ' ';
             }
-            std::cout << '\n';
+            info << '\n';
         }
     }
+    std::string message = info.str();
+    message.pop_back();
+    logSink->write(LogLevel::Debug, message);
 }
 
-// print info for the next scan
+// print info for the next scan, at the Debug log level
 void printScanInfo(const JPGImage* const image) {
-    if (image == nullptr) return;
-    std::cout << "SOS=============\n";
-    std::cout << "Start of Selection: " << (uint32_t)image->startOfSelection << '\n';
-    std::cout << "End of Selection: " << (uint32_t)image->endOfSelection << '\n';
-    std::cout << "Successive Approximation High: " << (uint32_t)image->successiveApproximationHigh << '\n';
-    std::cout << "Successive Approximation Low: " << (uint32_t)image->successiveApproximationLow << '\n';
-    std::cout << "Color Components:\n";
+    if (image == nullptr || logLevel < LogLevel::Debug) return;
+    std::ostringstream info;
+    info << "SOS=============\n";
+    info << "Start of Selection: " << (uint32_t)image->startOfSelection << '\n';
+    info << "End of Selection: " << (uint32_t)image->endOfSelection << '\n';
+    info << "Successive Approximation High: " << (uint32_t)image->successiveApproximationHigh << '\n';
+    info << "Successive Approximation Low: " << (uint32_t)image->successiveApproximationLow << '\n';
+    info << "Color Components:\n";
     for (uint32_t i = 0; i < image->numComponents; ++i) {
         if (image->colorComponents[i].usedInScan) {
-            std::cout << "Component ID: " << (i + 1) << '\n';
-            std::cout << "Huffman DC Table ID: " << (uint32_t)image->colorComponents[i].huffmanDCTableID << '\n';
-            std::cout << "Huffman AC Table ID: " << (uint32_t)image->colorComponents[i].huffmanACTableID << '\n';
+            info << "Component ID: " << (i + 1) << '\n';
+            info << "Huffman DC Table ID: " << (uint32_t)image->colorComponents[i].huffmanDCTableID << '\n';
+            info << "Huffman AC Table ID: " << (uint32_t)image->colorComponents[i].huffmanACTableID << '\n';
         }
     }
-    std::cout << "DHT=============\n";
-    std::cout << "DC Tables:\n";
+    info << "DHT=============\n";
+    info << "DC Tables:\n";
     for (uint32_t i = 0; i < 4; ++i) {
         if (image->huffmanDCTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Symbols:\n";
+            info << "Table ID: " << i << '\n';
+            info << "Symbols:\n";
             for (uint32_t j = 0; j < 16; ++j) {
-                std::cout << (j + 1) << ": ";
+                info << (j + 1) << ": ";
                 for (uint32_t k = image->huffmanDCTables[i].offsets[j]; k < image->huffmanDCTables[i].offsets[j + 1]; ++k) {
-                    std::cout << std::hex << (uint32_t)image->huffmanDCTables[i].symbols[k] << std::dec << ' ';
+                    info << std::hex << (uint32_t)image->huffmanDCTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << '\n';
+                info << '\n';
             }
         }
     }
-    std::cout << "AC Tables:\n";
+    info << "AC Tables:\n";
     for (uint32_t i = 0; i < 4; ++i) {
         if (image->huffmanACTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Symbols:\n";
+            info << "Table ID: " << i << '\n';
+            info << "Symbols:\n";
             for (uint32_t j = 0; j < 16; ++j) {
-                std::cout << (j + 1) << ": ";
+                info << (j + 1) << ": ";
                 for (uint32_t k = image->huffmanACTables[i].offsets[j]; k < image->huffmanACTables[i].offsets[j + 1]; ++k) {
-                    std::cout << std::hex << (uint32_t)image->huffmanACTables[i].symbols[k] << std::dec << ' ';
+                    info << std::hex << (uint32_t)image->huffmanACTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << '\n';
+                info << '\n';
             }
         }
     }
-    std::cout << "DRI=============\n";
-    std::cout << "Restart Interval: " << image->restartInterval << '\n';
+    info << "DRI=============\n";
+    info << "Restart Interval: " << image->restartInterval;
+    logSink->write(LogLevel::Debug, info.str());
 }
 
 void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
@@ -577,8 +1056,7 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     byte last = bitReader.readByte();
     byte current = bitReader.readByte();
     if (last != 0xFF || current != SOI) {
-        std::cout << "Error - SOI invalid\n";
-        image->isValid = false;
+        setError(image, DecodeError::InvalidMarker, "SOI invalid");
         return;
     }
     last = bitReader.readByte();
@@ -587,13 +1065,11 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     // read markers until first scan
     while (image->isValid) {
         if (!bitReader.hasBits()) {
-            std::cout << "Error - File ended prematurely\n";
-            image->isValid = false;
+            setError(image, DecodeError::TruncatedFile, "File ended prematurely");
             return;
         }
         if (last != 0xFF) {
-            std::cout << "Error - Expected a marker\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Expected a marker");
             return;
         }
 
@@ -641,33 +1117,27 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
         }
 
         else if (current == SOI) {
-            std::cout << "Error - Embedded JPGs not supported\n";
-            image->isValid = false;
+            setError(image, DecodeError::Unsupported, "Embedded JPGs not supported");
             return;
         }
         else if (current == EOI) {
-            std::cout << "Error - EOI detected before SOS\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "EOI detected before SOS");
             return;
         }
         else if (current == DAC) {
-            std::cout << "Error - Arithmetic Coding mode not supported\n";
-            image->isValid = false;
+            setError(image, DecodeError::Unsupported, "Arithmetic Coding mode not supported");
             return;
         }
         else if (current >= SOF0 && current <= SOF15) {
-            std::cout << "Error - SOF marker not supported: 0x" << std::hex << (uint32_t)current << std::dec << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::Unsupported, "SOF marker not supported: 0x", std::hex, (uint32_t)current);
             return;
         }
         else if (current >= RST0 && current <= RST7) {
-            std::cout << "Error - RSTN detected before SOS\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "RSTN detected before SOS");
             return;
         }
         else {
-            std::cout << "Error - Unknown marker: 0x" << std::hex << (uint32_t)current << std::dec << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Unknown marker: 0x", std::hex, (uint32_t)current);
             return;
         }
         last = bitReader.readByte();
@@ -675,16 +1145,100 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image);
+// number of bytes each pixel takes in a pixel format
+inline uint32_t getBytesPerPixel(const PixelFormat format) {
+    return format == PixelFormat::RGBA ? 4 : format == PixelFormat::GRAY ? 1 : 3;
+}
+
+// destination for decoded pixel rows, which arrive from the top of the image down
+class RowWriter {
+public:
+    virtual ~RowWriter() {}
+
+    // called once the frame header has been read, before any rows
+    virtual bool start(const JPGImage* const image) = 0;
+
+    // rows holds numRows rows of pixels in the image's pixel format,
+    //   outputWidth pixels each with no gaps between rows, the first of
+    //   which is row firstRow of the output
+    virtual bool writeRows(const byte* const rows, const uint32_t firstRow, const uint32_t numRows) = 0;
+};
+
+void decodeHuffmanData(BitReader& bitReader, JPGImage* const image, RowWriter* const writer);
+void skipHuffmanData(BitReader& bitReader);
+bool decodeHuffmanDataParallel(BitReader& bitReader, JPGImage* const image, ThreadPool& threadPool);
+bool processMCURow(JPGImage* const image, const uint32_t mcuRow, RowWriter* const writer);
+void inverseDCT(const JPGImage* const image, ThreadPool* const threadPool);
+void YCbCrToRGBMCURow(const JPGImage* const image, const uint32_t mcuRow, byte* const pixels, const size_t stride);
+
+// whether converting an MCU row needs the MCU rows above and below it
+inline bool hasVerticalContext(const JPGImage* const image) {
+    return image->fancyUpsampling && image->verticalSamplingFactor > 1;
+}
+
+// find the output rows that numMCURows MCU rows starting at firstMCURow cover
+void getOutputRows(const JPGImage* const image, const uint32_t firstMCURow, const uint32_t numMCURows, uint32_t& firstRow, uint32_t& numRows) {
+    const uint32_t mcuHeight = image->verticalSamplingFactor * 8 / image->scale;
+    const uint32_t top = std::max(firstMCURow * mcuHeight, image->outputY);
+    const uint32_t bottom = std::min((firstMCURow + numMCURows) * mcuHeight, image->outputY + image->outputHeight);
+    firstRow = top - image->outputY;
+    numRows = bottom > top ? bottom - top : 0;
+}
+
+// whether decoding at the image's scale never uses the coefficients
+//   that the current progressive scan holds
+// at 1/8 size only DC coefficients are used, at other sizes AC scans
+//   cannot be skipped, as the refinement of a band that is used may
+//   depend on the earlier scans of coefficients that are not
+bool scanIsUnused(const JPGImage* const image) {
+    return image->frameType == SOF2 && image->scale == 8 && image->startOfSelection != 0;
+}
 
-void readScans(BitReader& bitReader, JPGImage* const image) {
+// baseline scans are streamed to writer one MCU row at a time when it is not null
+// baseline scans with restart intervals are decoded on threadPool when it is not null
+void readScans(BitReader& bitReader, JPGImage* const image, RowWriter* const writer, ThreadPool* const threadPool) {
     // decode first scan
     readStartOfScan(bitReader, image);
     if (!image->isValid) {
         return;
     }
     printScanInfo(image);
-    decodeHuffmanData(bitReader, image);
+    if (writer != nullptr && image->componentsInScan != image->numComponents) {
+        setError(image, DecodeError::Unsupported, "Baseline scan must include all components");
+        return;
+    }
+    if (scanIsUnused(image)) {
+        skipHuffmanData(bitReader);
+    }
+    else if (threadPool != nullptr && decodeHuffmanDataParallel(bitReader, image, *threadPool)) {
+        if (writer != nullptr) {
+            inverseDCT(image, threadPool);
+            // the pixel buffer holds one MCU row per thread, so that
+            //   color conversion can also run in parallel
+            const uint32_t bandRows = threadPool->getNumThreads();
+            const size_t stride = (size_t)image->outputWidth * getBytesPerPixel(image->pixelFormat);
+            for (uint32_t firstMCURow = image->firstMCURow; firstMCURow < image->endMCURow && image->isValid; firstMCURow += bandRows) {
+                const uint32_t numMCURows = std::min(bandRows, image->endMCURow - firstMCURow);
+                uint32_t firstRow = 0;
+                uint32_t numRows = 0;
+                getOutputRows(image, firstMCURow, numMCURows, firstRow, numRows);
+                threadPool->parallelFor(numMCURows, [&](const uint32_t i) {
+                    uint32_t mcuFirstRow = 0;
+                    uint32_t mcuNumRows = 0;
+                    getOutputRows(image, firstMCURow + i, 1, mcuFirstRow, mcuNumRows);
+                    YCbCrToRGBMCURow(image, firstMCURow + i, image->pixels + (mcuFirstRow - firstRow) * stride, stride);
+                });
+                if (numRows != 0 && !writer->writeRows(image->pixels, firstRow, numRows)) {
+                    // the writer reports its own errors
+                    image->isValid = false;
+                    image->error = DecodeError::WriteFailed;
+                }
+            }
+        }
+    }
+    else {
+        decodeHuffmanData(bitReader, image, writer);
+    }
 
     byte last = bitReader.readByte();
     byte current = bitReader.readByte();
@@ -692,13 +1246,11 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
     // decode additional scans, if any
     while (image->isValid) {
         if (!bitReader.hasBits()) {
-            std::cout << "Error - File ended prematurely\n";
-            image->isValid = false;
+            setError(image, DecodeError::TruncatedFile, "File ended prematurely");
             return;
         }
         if (last != 0xFF) {
-            std::cout << "Error - Expected a marker\n";
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Expected a marker");
             return;
         }
 
@@ -717,7 +1269,12 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
                 return;
             }
             printScanInfo(image);
-            decodeHuffmanData(bitReader, image);
+            if (scanIsUnused(image)) {
+                skipHuffmanData(bitReader);
+            }
+            else {
+                decodeHuffmanData(bitReader, image, nullptr);
+            }
         }
         // new restart interval (progressive only)
         else if (current == DRI && image->frameType == SOF2) {
@@ -733,8 +1290,7 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
             continue;
         }
         else {
-            std::cout << "Error - Invalid marker: 0x" << std::hex << (uint32_t)current << std::dec << '\n';
-            image->isValid = false;
+            setError(image, DecodeError::InvalidMarker, "Invalid marker: 0x", std::hex, (uint32_t)current);
             return;
         }
         last = bitReader.readByte();
@@ -742,46 +1298,170 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-JPGImage* readJPG(const std::string& filename) {
-    // open file
-    std::cout << "Reading " << filename << "...\n";
-    BitReader bitReader(filename);
-    if (!bitReader.hasBits()) {
-        std::cout << "Error - Error opening input file\n";
-        return nullptr;
-    }
-
-    JPGImage* image = new (std::nothrow) JPGImage;
-    if (image == nullptr) {
-        std::cout << "Error - Memory error\n";
-        return nullptr;
+// decode a JPG held in memory, the data is only read during this call
+// baseline JPGs are streamed to writer, if given, which bounds memory use
+//   by the image width, the pixels of progressive JPGs are left to the caller
+// baseline JPGs with restart intervals are decoded in parallel on
+//   threadPool, if given, which needs memory for the whole image
+// the pixels are decoded at 1/scale of the full size, where scale is
+//   1, 2, 4 or 8, using reduced IDCTs
+// only the pixels inside the crop rectangle, if cropping, are decoded,
+//   and baseline JPGs then only need memory for those
+// with integerIDCT, full size blocks are transformed with fixed-point math,
+//   whose results are the same on every compiler and CPU
+// image must be newly constructed, apart from its arena
+void readJPG(JPGImage* const image, const byte* const data, const size_t size, RowWriter* const writer, ThreadPool* const threadPool, const DecodeOptions& options) {
+    BitReader bitReader(data, size);
+
+    const uint32_t scale = options.scale;
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        setError(image, DecodeError::InvalidOption, "Invalid scale: 1/", scale);
+        return;
     }
+    image->scale = scale;
+    image->integerIDCT = options.integerIDCT;
+    image->pixelFormat = options.pixelFormat;
 
     readFrameHeader(bitReader, image);
 
     if (!image->isValid) {
-        return image;
+        return;
     }
 
     printFrameInfo(image);
 
-    image->blocks = new (std::nothrow) Block[image->blockHeightReal * image->blockWidthReal];
-    if (image->blocks == nullptr) {
-        std::cout << "Error - Memory error\n";
-        image->isValid = false;
-        return image;
+    image->outputWidth = (image->width + image->scale - 1) / image->scale;
+    image->outputHeight = (image->height + image->scale - 1) / image->scale;
+    if (options.cropping) {
+        const CropRect* const crop = &options.crop;
+        if (crop->x >= image->outputWidth || crop->y >= image->outputHeight ||
+            crop->width == 0 || crop->height == 0) {
+            setError(image, DecodeError::InvalidOption, "Crop rectangle outside the image");
+            return;
+        }
+        image->outputX = crop->x;
+        image->outputY = crop->y;
+        image->outputWidth = std::min(crop->width, image->outputWidth - crop->x);
+        image->outputHeight = std::min(crop->height, image->outputHeight - crop->y);
+    }
+    const uint32_t mcuWidth = image->horizontalSamplingFactor * 8 / image->scale;
+    const uint32_t mcuHeight = image->verticalSamplingFactor * 8 / image->scale;
+    image->firstMCURow = image->outputY / mcuHeight;
+    image->endMCURow = (image->outputY + image->outputHeight + mcuHeight - 1) / mcuHeight;
+    image->firstMCUColumn = image->outputX / mcuWidth;
+    image->endMCUColumn = (image->outputX + image->outputWidth + mcuWidth - 1) / mcuWidth;
+    // fancy upsampling interpolates with the chrominance of the next MCU
+    //   in each direction that the chrominance is subsampled in
+    image->fancyUpsampling = options.fancyUpsampling && image->numComponents == 3 &&
+        (image->horizontalSamplingFactor > 1 || image->verticalSamplingFactor > 1);
+    if (image->fancyUpsampling && image->verticalSamplingFactor > 1) {
+        image->firstMCURow -= image->firstMCURow > 0 ? 1 : 0;
+        image->endMCURow = std::min(image->endMCURow + 1, image->blockHeightReal / image->verticalSamplingFactor);
+    }
+    if (image->fancyUpsampling && image->horizontalSamplingFactor > 1) {
+        image->firstMCUColumn -= image->firstMCUColumn > 0 ? 1 : 0;
+        image->endMCUColumn = std::min(image->endMCUColumn + 1, image->blockWidthReal / image->horizontalSamplingFactor);
+    }
+
+    // only baseline JPGs can be streamed or split at restart markers
+    // cropped JPGs are split at restart markers even without extra
+    //   threads, so that intervals outside the crop can be skipped
+    RowWriter* const rowWriter = image->frameType == SOF0 ? writer : nullptr;
+    ThreadPool* const rowThreadPool = image->frameType == SOF0 && image->restartInterval != 0 &&
+        threadPool != nullptr && (threadPool->getNumThreads() > 1 || options.cropping) ? threadPool : nullptr;
+    if (rowWriter != nullptr) {
+        // only one MCU row of pixels per thread is ever held
+        const uint32_t mcuRows = rowThreadPool != nullptr ? rowThreadPool->getNumThreads() : 1;
+        image->pixels = allocateBuffer<byte>(image, (size_t)mcuRows * mcuHeight * image->outputWidth * getBytesPerPixel(image->pixelFormat));
+        if (image->pixels == nullptr) {
+            setError(image, DecodeError::OutOfMemory, "Memory error");
+            return;
+        }
+        if (!rowWriter->start(image)) {
+            image->isValid = false;
+            image->error = DecodeError::WriteFailed;
+            return;
+        }
+    }
+
+    // each component gets its own plane of blocks, sized by its sampling
+    //   factors so subsampled and missing components take no extra space
+    // baseline planes only hold the MCUs that overlap the output, and
+    //   just one MCU row of them when streaming serially, or three with
+    //   vertical fancy upsampling as each MCU row is converted once the
+    //   next one has been decoded
+    // progressive planes hold every MCU, as refining a block's
+    //   coefficients depends on the ones decoded before
+    for (uint32_t i = 0; i < image->numComponents; ++i) {
+        ColorComponent& component = image->colorComponents[i];
+        const uint32_t v = component.verticalSamplingFactor;
+        const uint32_t h = component.horizontalSamplingFactor;
+        if (image->frameType == SOF0) {
+            component.firstBlockRow = image->firstMCURow * v;
+            component.endBlockRow = image->endMCURow * v;
+            component.firstBlockColumn = image->firstMCUColumn * h;
+            component.blockWidth = (image->endMCUColumn - image->firstMCUColumn) * h;
+        }
+        else {
+            component.endBlockRow = image->blockHeightReal / image->verticalSamplingFactor * v;
+            component.blockWidth = image->blockWidthReal / image->horizontalSamplingFactor * h;
+        }
+        component.blockHeight = rowWriter != nullptr && rowThreadPool == nullptr ?
+            (hasVerticalContext(image) ? 3 * v : v) :
+            component.endBlockRow - component.firstBlockRow;
+        const size_t numBlocks = (size_t)component.blockHeight * component.blockWidth;
+        component.blocks = allocateBuffer<int16_t>(image, numBlocks * 64);
+        component.lastNonzero = allocateBuffer<byte>(image, numBlocks);
+        if (component.blocks == nullptr || component.lastNonzero == nullptr) {
+            setError(image, DecodeError::OutOfMemory, "Memory error");
+            return;
+        }
+        std::fill(component.blocks, component.blocks + numBlocks * 64, 0);
+        std::fill(component.lastNonzero, component.lastNonzero + numBlocks, 0);
     }
 
-    readScans(bitReader, image);
+    readScans(bitReader, image, rowWriter, rowThreadPool);
+}
 
+// decode a JPG held in memory into a new image, see above
+JPGImage* readJPG(const byte* const data, const size_t size, RowWriter* const writer, ThreadPool* const threadPool, const DecodeOptions& options) {
+    JPGImage* image = new (std::nothrow) JPGImage;
+    if (image == nullptr) {
+        logMessage(LogLevel::Error, "Error - Memory error");
+        return nullptr;
+    }
+    readJPG(image, data, size, writer, threadPool, options);
     return image;
 }
 
-// return the symbol from the Huffman table that corresponds to
-// the next Huffman code read from the BitReader
-byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
-    uint32_t currentCode = 0;
-    for (uint32_t i = 0; i < 16; ++i) {
+// decode a JPG file into a new image, see above
+// a file that cannot be opened gives an invalid image with OpenFailed
+JPGImage* readJPG(const std::string& filename, RowWriter* const writer, ThreadPool* const threadPool, const DecodeOptions& options) {
+    // open file
+    logMessage(LogLevel::Info, "Reading ", filename, "...");
+    const MappedFile file(filename);
+    if (!file.isOpen()) {
+        JPGImage* image = new (std::nothrow) JPGImage;
+        if (image == nullptr) {
+            logMessage(LogLevel::Error, "Error - Memory error");
+            return nullptr;
+        }
+        setError(image, DecodeError::OpenFailed, "Error opening input file");
+        return image;
+    }
+
+    return readJPG(file.getData(), file.getSize(), writer, threadPool, options);
+}
+
+// when false, getNextSymbol skips the lookup arrays and matches every
+//   code bit by bit (only used to benchmark the lookup)
+bool huffmanLookupEnabled = true;
+
+// return the symbol from the Huffman table whose code begins with the
+//   codeLength bits of currentCode, reading the rest of the code one bit
+//   at a time from the BitReader
+byte getLongSymbol(BitReader& bitReader, const HuffmanTable& hTable, uint32_t currentCode, const uint32_t codeLength) {
+    for (uint32_t i = codeLength; i < 16; ++i) {
         int bit = bitReader.readBit();
         if (bit == -1) {
             return -1;
@@ -796,12 +1476,34 @@ byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
     return -1;
 }
 
+// return the symbol from the Huffman table that corresponds to
+// the next Huffman code read from the BitReader
+byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
+    if (!huffmanLookupEnabled) {
+        return getLongSymbol(bitReader, hTable, 0, 0);
+    }
+    const uint32_t lookahead = bitReader.peekBits(huffmanLookupBits);
+    const byte codeLength = hTable.lookupLengths[lookahead];
+    if (codeLength != 0) {
+        if (!bitReader.consumeBits(codeLength)) {
+            return -1;
+        }
+        return hTable.lookupSymbols[lookahead];
+    }
+    // codes longer than huffmanLookupBits take the slow path
+    if (!bitReader.consumeBits(huffmanLookupBits)) {
+        return -1;
+    }
+    return getLongSymbol(bitReader, hTable, lookahead, huffmanLookupBits);
+}
+
 // fill the coefficients of a block component based on Huffman codes
 // read from the BitReader
 bool decodeBlockComponent(
     const JPGImage* const image,
     BitReader& bitReader,
-    int* const component,
+    int16_t* const component,
+    byte& lastNonzero,
     int& previousDC,
     uint32_t& skips,
     const HuffmanTable& dcTable,
@@ -811,17 +1513,17 @@ bool decodeBlockComponent(
         // get the DC value for this block component
         byte length = getNextSymbol(bitReader, dcTable);
         if (length == (byte)-1) {
-            std::cout << "Error - Invalid DC value\n";
+            logMessage(LogLevel::Error, "Error - Invalid DC value");
             return false;
         }
         if (length > 11) {
-            std::cout << "Error - DC coefficient length greater than 11\n";
+            logMessage(LogLevel::Error, "Error - DC coefficient length greater than 11");
             return false;
         }
 
         int coeff = bitReader.readBits(length);
         if (coeff == -1) {
-            std::cout << "Error - Invalid DC value\n";
+            logMessage(LogLevel::Error, "Error - Invalid DC value");
             return false;
         }
         if (length != 0 && coeff < (1 << (length - 1))) {
@@ -829,12 +1531,13 @@ bool decodeBlockComponent(
         }
         component[0] = coeff + previousDC;
         previousDC = component[0];
+        lastNonzero = 0;
 
         // get the AC values for this block component
         for (uint32_t i = 1; i < 64; ++i) {
             byte symbol = getNextSymbol(bitReader, acTable);
             if (symbol == (byte)-1) {
-                std::cout << "Error - Invalid AC value\n";
+                logMessage(LogLevel::Error, "Error - Invalid AC value");
                 return false;
             }
 
@@ -849,24 +1552,25 @@ bool decodeBlockComponent(
             coeff = 0;
 
             if (i + numZeroes >= 64) {
-                std::cout << "Error - Zero run-length exceeded block component\n";
+                logMessage(LogLevel::Error, "Error - Zero run-length exceeded block component");
                 return false;
             }
             i += numZeroes;
 
             if (coeffLength > 10) {
-                std::cout << "Error - AC coefficient length greater than 10\n";
+                logMessage(LogLevel::Error, "Error - AC coefficient length greater than 10");
                 return false;
             }
             coeff = bitReader.readBits(coeffLength);
             if (coeff == -1) {
-                std::cout << "Error - Invalid AC value\n";
+                logMessage(LogLevel::Error, "Error - Invalid AC value");
                 return false;
             }
             if (coeff < (1 << (coeffLength - 1))) {
                 coeff -= (1 << coeffLength) - 1;
             }
             component[zigZagMap[i]] = coeff;
+            lastNonzero = i;
         }
         return true;
     }
@@ -875,17 +1579,17 @@ bool decodeBlockComponent(
             // DC first visit
             byte length = getNextSymbol(bitReader, dcTable);
             if (length == (byte)-1) {
-                std::cout << "Error - Invalid DC value\n";
+                logMessage(LogLevel::Error, "Error - Invalid DC value");
                 return false;
             }
             if (length > 11) {
-                std::cout << "Error - DC coefficient length greater than 11\n";
+                logMessage(LogLevel::Error, "Error - DC coefficient length greater than 11");
                 return false;
             }
 
             int coeff = bitReader.readBits(length);
             if (coeff == -1) {
-                std::cout << "Error - Invalid DC value\n";
+                logMessage(LogLevel::Error, "Error - Invalid DC value");
                 return false;
             }
             if (length != 0 && coeff < (1 << (length - 1))) {
@@ -900,7 +1604,7 @@ bool decodeBlockComponent(
             // DC refinement
             int bit = bitReader.readBit();
             if (bit == -1) {
-                std::cout << "Error - Invalid DC value\n";
+                logMessage(LogLevel::Error, "Error - Invalid DC value");
                 return false;
             }
             component[0] |= bit << image->successiveApproximationLow;
@@ -915,7 +1619,7 @@ bool decodeBlockComponent(
             for (uint32_t i = image->startOfSelection; i <= image->endOfSelection; ++i) {
                 byte symbol = getNextSymbol(bitReader, acTable);
                 if (symbol == (byte)-1) {
-                    std::cout << "Error - Invalid AC value\n";
+                    logMessage(LogLevel::Error, "Error - Invalid AC value");
                     return false;
                 }
 
@@ -924,31 +1628,32 @@ bool decodeBlockComponent(
 
                 if (coeffLength != 0) {
                     if (i + numZeroes > image->endOfSelection) {
-                        std::cout << "Error - Zero run-length exceeded spectral selection\n";
+                        logMessage(LogLevel::Error, "Error - Zero run-length exceeded spectral selection");
                         return false;
                     }
                     for (uint32_t j = 0; j < numZeroes; ++j, ++i) {
                         component[zigZagMap[i]] = 0;
                     }
                     if (coeffLength > 10) {
-                        std::cout << "Error - AC coefficient length greater than 10\n";
+                        logMessage(LogLevel::Error, "Error - AC coefficient length greater than 10");
                         return false;
                     }
 
                     int coeff = bitReader.readBits(coeffLength);
                     if (coeff == -1) {
-                        std::cout << "Error - Invalid AC value\n";
+                        logMessage(LogLevel::Error, "Error - Invalid AC value");
                         return false;
                     }
                     if (coeff < (1 << (coeffLength - 1))) {
                         coeff -= (1 << coeffLength) - 1;
                     }
                     component[zigZagMap[i]] = coeff << image->successiveApproximationLow;
+                    lastNonzero = std::max(lastNonzero, (byte)i);
                 }
                 else {
                     if (numZeroes == 15) {
                         if (i + numZeroes > image->endOfSelection) {
-                            std::cout << "Error - Zero run-length exceeded spectral selection\n";
+                            logMessage(LogLevel::Error, "Error - Zero run-length exceeded spectral selection");
                             return false;
                         }
                         for (uint32_t j = 0; j < numZeroes; ++j, ++i) {
@@ -959,7 +1664,7 @@ bool decodeBlockComponent(
                         skips = (1 << numZeroes) - 1;
                         uint32_t extraSkips = bitReader.readBits(numZeroes);
                         if (extraSkips == (uint32_t)-1) {
-                            std::cout << "Error - Invalid AC value\n";
+                            logMessage(LogLevel::Error, "Error - Invalid AC value");
                             return false;
                         }
                         skips += extraSkips;
@@ -978,7 +1683,7 @@ bool decodeBlockComponent(
                 for (; i <= image->endOfSelection; ++i) {
                     byte symbol = getNextSymbol(bitReader, acTable);
                     if (symbol == (byte)-1) {
-                        std::cout << "Error - Invalid AC value\n";
+                        logMessage(LogLevel::Error, "Error - Invalid AC value");
                         return false;
                     }
 
@@ -988,7 +1693,7 @@ bool decodeBlockComponent(
 
                     if (coeffLength != 0) {
                         if (coeffLength != 1) {
-                            std::cout << "Error - Invalid AC value\n";
+                            logMessage(LogLevel::Error, "Error - Invalid AC value");
                             return false;
                         }
                         switch (bitReader.readBit()) {
@@ -999,7 +1704,7 @@ bool decodeBlockComponent(
                             coeff = negative;
                             break;
                         default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
+                            logMessage(LogLevel::Error, "Error - Invalid AC value");
                             return false;
                         }
                     }
@@ -1008,7 +1713,7 @@ bool decodeBlockComponent(
                             skips = 1 << numZeroes;
                             uint32_t extraSkips = bitReader.readBits(numZeroes);
                             if (extraSkips == (uint32_t)-1) {
-                                std::cout << "Error - Invalid AC value\n";
+                                logMessage(LogLevel::Error, "Error - Invalid AC value");
                                 return false;
                             }
                             skips += extraSkips;
@@ -1033,7 +1738,7 @@ bool decodeBlockComponent(
                                 // do nothing
                                 break;
                             default: // -1, data stream is empty
-                                std::cout << "Error - Invalid AC value\n";
+                                logMessage(LogLevel::Error, "Error - Invalid AC value");
                                 return false;
                             }
                         }
@@ -1049,6 +1754,7 @@ bool decodeBlockComponent(
 
                     if (coeff != 0 && i <= image->endOfSelection) {
                         component[zigZagMap[i]] = coeff;
+                        lastNonzero = std::max(lastNonzero, (byte)i);
                     }
                 }
             }
@@ -1071,7 +1777,7 @@ bool decodeBlockComponent(
                             // do nothing
                             break;
                         default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
+                            logMessage(LogLevel::Error, "Error - Invalid AC value");
                             return false;
                         }
                     }
@@ -1083,19 +1789,110 @@ bool decodeBlockComponent(
     }
 }
 
+// whether a component's plane holds the block at (blockRow, blockColumn)
+inline bool holdsBlock(const ColorComponent& component, const uint32_t blockRow, const uint32_t blockColumn) {
+    return blockRow >= component.firstBlockRow && blockRow < component.endBlockRow &&
+        blockColumn >= component.firstBlockColumn && blockColumn - component.firstBlockColumn < component.blockWidth;
+}
+
+// index of the block at (blockRow, blockColumn) in a component's plane,
+//   which must hold it
+inline uint32_t getBlockIndex(const ColorComponent& component, const uint32_t blockRow, const uint32_t blockColumn) {
+    return (blockRow - component.firstBlockRow) % component.blockHeight * component.blockWidth +
+        (blockColumn - component.firstBlockColumn);
+}
+
+// decode one MCU of the current scan, whose top left block is block
+//   (y, x) of the image, into the planes
+// blocks that the planes do not hold are decoded and thrown away
+bool decodeMCU(BitReader& bitReader, JPGImage* const image, const uint32_t y, const uint32_t x, int* const previousDCs, uint32_t& skips) {
+    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
+    const uint32_t yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint32_t xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+
+    int16_t discardedBlock[64];
+    byte discardedLastNonzero = 0;
+
+    for (uint32_t i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        if (component.usedInScan) {
+            const uint32_t vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
+            const uint32_t hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
+            for (uint32_t v = 0; v < vMax; ++v) {
+                for (uint32_t h = 0; h < hMax; ++h) {
+                    const uint32_t blockRow = y / yStep * vMax + v;
+                    const uint32_t blockColumn = x / xStep * hMax + h;
+                    const bool held = holdsBlock(component, blockRow, blockColumn);
+                    const uint32_t blockIndex = held ? getBlockIndex(component, blockRow, blockColumn) : 0;
+                    if (!decodeBlockComponent(
+                        image,
+                        bitReader,
+                        held ? component.blocks + blockIndex * 64 : discardedBlock,
+                        held ? component.lastNonzero[blockIndex] : discardedLastNonzero,
+                        previousDCs[i],
+                        skips,
+                        image->huffmanDCTables[component.huffmanDCTableID],
+                        image->huffmanACTables[component.huffmanACTableID])) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// zero the blocks of an MCU that could not be decoded, leaving it blank
+void clearMCU(JPGImage* const image, const uint32_t y, const uint32_t x) {
+    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
+    const uint32_t yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint32_t xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+
+    for (uint32_t i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        if (component.usedInScan) {
+            const uint32_t vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
+            const uint32_t hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
+            for (uint32_t v = 0; v < vMax; ++v) {
+                for (uint32_t h = 0; h < hMax; ++h) {
+                    const uint32_t blockRow = y / yStep * vMax + v;
+                    const uint32_t blockColumn = x / xStep * hMax + h;
+                    if (holdsBlock(component, blockRow, blockColumn)) {
+                        const uint32_t blockIndex = getBlockIndex(component, blockRow, blockColumn);
+                        std::fill(component.blocks + blockIndex * 64, component.blocks + blockIndex * 64 + 64, 0);
+                        component.lastNonzero[blockIndex] = 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
 // decode all the Huffman data and fill all MCUs
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
+// with a writer, each MCU row is finished and written out as soon as it
+//   has been decoded, so the planes may hold just one MCU row
+// decoding stops after the last MCU row that overlaps the output
+// from a corrupt MCU on, the rest of the scan is left blank, but its MCU
+//   rows are still finished and written
+void decodeHuffmanData(BitReader& bitReader, JPGImage* const image, RowWriter* const writer) {
     int previousDCs[3] = { 0 };
     uint32_t skips = 0;
+    bool corrupt = false;
 
     const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
     const uint32_t yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
     const uint32_t xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
-    const uint32_t restartInterval = image->restartInterval * xStep * yStep;
+    const uint32_t mcusPerRow = (image->blockWidth + xStep - 1) / xStep;
+    const uint32_t restartInterval = image->restartInterval;
 
     for (uint32_t y = 0; y < image->blockHeight; y += yStep) {
-        for (uint32_t x = 0; x < image->blockWidth; x += xStep) {
-            if (restartInterval != 0 && (y * image->blockWidthReal + x) % restartInterval == 0) {
+        if (y >= image->endMCURow * image->verticalSamplingFactor) {
+            skipHuffmanData(bitReader);
+            return;
+        }
+        for (uint32_t x = 0; x < image->blockWidth && !corrupt; x += xStep) {
+            const uint32_t mcuIndex = y / yStep * mcusPerRow + x / xStep;
+            if (restartInterval != 0 && mcuIndex % restartInterval == 0) {
                 previousDCs[0] = 0;
                 previousDCs[1] = 0;
                 previousDCs[2] = 0;
@@ -1103,70 +1900,163 @@ void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
                 bitReader.align();
             }
 
+            if (!decodeMCU(bitReader, image, y, x, previousDCs, skips)) {
+                image->error = DecodeError::CorruptData;
+                clearMCU(image, y, x);
+                skipHuffmanData(bitReader);
+                corrupt = true;
+            }
+        }
+
+        const uint32_t mcuRow = y / image->verticalSamplingFactor;
+        if (writer != nullptr && mcuRow >= image->firstMCURow &&
+            ((y + yStep) % image->verticalSamplingFactor == 0 || y + yStep >= image->blockHeight)) {
+            if (!processMCURow(image, mcuRow, writer)) {
+                image->isValid = false;
+                image->error = DecodeError::WriteFailed;
+                return;
+            }
+            // planes that only hold a few MCU rows reuse the oldest one's
+            //   blocks for the next
             for (uint32_t i = 0; i < image->numComponents; ++i) {
                 const ColorComponent& component = image->colorComponents[i];
-                if (component.usedInScan) {
-                    const uint32_t vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
-                    const uint32_t hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
-                    for (uint32_t v = 0; v < vMax; ++v) {
-                        for (uint32_t h = 0; h < hMax; ++h) {
-                            if (!decodeBlockComponent(
-                                image,
-                                bitReader,
-                                image->blocks[(y + v) * image->blockWidthReal + (x + h)][i],
-                                previousDCs[i],
-                                skips,
-                                image->huffmanDCTables[component.huffmanDCTableID],
-                                image->huffmanACTables[component.huffmanACTableID])) {
-                                return;
-                            }
-                        }
-                    }
+                const uint32_t nextBlockRow = (mcuRow + 1) * component.verticalSamplingFactor;
+                if (component.blockHeight < component.endBlockRow - component.firstBlockRow &&
+                    nextBlockRow < component.endBlockRow) {
+                    int16_t* const blocks = component.blocks + getBlockIndex(component, nextBlockRow, component.firstBlockColumn) * 64;
+                    std::fill(blocks, blocks + component.verticalSamplingFactor * component.blockWidth * 64, 0);
                 }
             }
         }
     }
 }
 
-// dequantize a block component based on a quantization table
-void dequantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
-    for (uint32_t i = 0; i < 64; ++i) {
-        component[i] *= qTable.table[i];
+// find where each restart interval of the entropy-coded data beginning at
+//   position starts, if intervalStarts is not null, and return the
+//   position of the marker that ends the data
+size_t findRestartIntervals(const byte* const data, const size_t size, size_t position, std::vector<size_t>* const intervalStarts) {
+    if (intervalStarts != nullptr) {
+        intervalStarts->push_back(position);
     }
+    while (position < size) {
+        const byte* const found = (const byte*)std::memchr(data + position, 0xFF, size - position);
+        if (found == nullptr || found + 1 == data + size) {
+            return size;
+        }
+        position = found - data;
+        const byte marker = data[position + 1];
+        // literal 0xFF's are encoded in the bitstream as 0xFF00
+        if (marker == 0x00) {
+            position += 2;
+        }
+        // any number of 0xFF in a row is allowed before a marker
+        else if (marker == 0xFF) {
+            position += 1;
+        }
+        else if (marker >= RST0 && marker <= RST7) {
+            position += 2;
+            if (intervalStarts != nullptr) {
+                intervalStarts->push_back(position);
+            }
+        }
+        else {
+            return position;
+        }
+    }
+    return size;
 }
 
-// dequantize all MCUs
-void dequantize(const JPGImage* const image) {
-    for (uint32_t y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint32_t x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint32_t i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                for (uint32_t v = 0; v < component.verticalSamplingFactor; ++v) {
-                    for (uint32_t h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        dequantizeBlockComponent(image->quantizationTables[component.quantizationTableID],
-                            image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
-                    }
+// move past the entropy-coded data of a scan without decoding it
+void skipHuffmanData(BitReader& bitReader) {
+    bitReader.seek(findRestartIntervals(bitReader.getData(), bitReader.getSize(), bitReader.getPosition(), nullptr));
+}
+
+// decode a baseline scan by splitting it at its RSTN markers and decoding
+//   the restart intervals on the thread pool
+// return false without consuming anything if the scan cannot be split,
+//   so that it can be decoded serially instead
+bool decodeHuffmanDataParallel(BitReader& bitReader, JPGImage* const image, ThreadPool& threadPool) {
+    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
+    const uint32_t yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint32_t xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+    const uint32_t mcusPerRow = (image->blockWidth + xStep - 1) / xStep;
+    const uint32_t mcuRows = (image->blockHeight + yStep - 1) / yStep;
+    const uint32_t numMCUs = mcusPerRow * mcuRows;
+    const uint32_t restartInterval = image->restartInterval;
+    const uint32_t numIntervals = (numMCUs + restartInterval - 1) / restartInterval;
+
+    // kept by the thread so that its capacity carries over to the next image
+    // the tasks use it through a reference, as in them the thread_local
+    //   name would refer to each worker's own vector
+    thread_local std::vector<size_t> threadIntervalStarts;
+    std::vector<size_t>& intervalStarts = threadIntervalStarts;
+    intervalStarts.clear();
+    const byte* const data = bitReader.getData();
+    const size_t end = findRestartIntervals(data, bitReader.getSize(), bitReader.getPosition(), &intervalStarts);
+    // missing or extra RSTN markers leave the intervals' MCUs unknown
+    if (intervalStarts.size() != numIntervals) {
+        return false;
+    }
+
+    std::atomic<bool> corrupt(false);
+    threadPool.parallelFor(numIntervals, [&](const uint32_t interval) {
+        // each interval stops before the 2-byte RSTN marker that follows it
+        const size_t intervalEnd = interval + 1 < numIntervals ? intervalStarts[interval + 1] - 2 : end;
+        BitReader intervalReader(data + intervalStarts[interval], intervalEnd - intervalStarts[interval]);
+        int previousDCs[3] = { 0 };
+        uint32_t skips = 0;
+        const uint32_t firstMCU = interval * restartInterval;
+        const uint32_t lastMCU = std::min(numMCUs, (interval + 1) * restartInterval);
+        // intervals without any MCU that overlaps the output are skipped
+        bool needed = false;
+        for (uint32_t mcu = firstMCU; mcu < lastMCU && !needed; ++mcu) {
+            const uint32_t mcuRow = mcu / mcusPerRow * yStep / image->verticalSamplingFactor;
+            const uint32_t mcuColumn = mcu % mcusPerRow * xStep / image->horizontalSamplingFactor;
+            needed = mcuRow >= image->firstMCURow && mcuRow < image->endMCURow &&
+                mcuColumn >= image->firstMCUColumn && mcuColumn < image->endMCUColumn;
+        }
+        if (!needed) {
+            return;
+        }
+        for (uint32_t mcu = firstMCU; mcu < lastMCU; ++mcu) {
+            const uint32_t y = mcu / mcusPerRow * yStep;
+            const uint32_t x = mcu % mcusPerRow * xStep;
+            if (!decodeMCU(intervalReader, image, y, x, previousDCs, skips)) {
+                // the whole interval is left blank, the rows it covers are
+                //   still written with the others
+                for (uint32_t blankMCU = firstMCU; blankMCU < lastMCU; ++blankMCU) {
+                    clearMCU(image, blankMCU / mcusPerRow * yStep, blankMCU % mcusPerRow * xStep);
                 }
+                corrupt = true;
+                return;
             }
         }
+    });
+    if (corrupt) {
+        image->error = DecodeError::CorruptData;
     }
+
+    bitReader.seek(end);
+    return true;
 }
 
-// perform 1-D IDCT on all columns and rows of a block component
-//   resulting in 2-D IDCT
-void inverseDCTBlockComponent(int* const component) {
+// dequantize a block component and perform 1-D IDCT on all its columns
+//   and rows resulting in 2-D IDCT
+// scaledTable already holds the scale factors of both passes, see
+//   scaleQuantizationTable
+void inverseDCTBlockComponent(int16_t* const component, const float* const scaledTable) {
 
     float intermediate[64];
 
     for (uint32_t i = 0; i < 8; ++i) {
-        const float g0 = component[0 * 8 + i] * s0;
-        const float g1 = component[4 * 8 + i] * s4;
-        const float g2 = component[2 * 8 + i] * s2;
-        const float g3 = component[6 * 8 + i] * s6;
-        const float g4 = component[5 * 8 + i] * s5;
-        const float g5 = component[1 * 8 + i] * s1;
-        const float g6 = component[7 * 8 + i] * s7;
-        const float g7 = component[3 * 8 + i] * s3;
+        const float g0 = component[0 * 8 + i] * scaledTable[0 * 8 + i];
+        const float g1 = component[4 * 8 + i] * scaledTable[4 * 8 + i];
+        const float g2 = component[2 * 8 + i] * scaledTable[2 * 8 + i];
+        const float g3 = component[6 * 8 + i] * scaledTable[6 * 8 + i];
+        const float g4 = component[5 * 8 + i] * scaledTable[5 * 8 + i];
+        const float g5 = component[1 * 8 + i] * scaledTable[1 * 8 + i];
+        const float g6 = component[7 * 8 + i] * scaledTable[7 * 8 + i];
+        const float g7 = component[3 * 8 + i] * scaledTable[3 * 8 + i];
 
         const float f0 = g0;
         const float f1 = g1;
@@ -1226,14 +2116,14 @@ void inverseDCTBlockComponent(int* const component) {
         intermediate[7 * 8 + i] = b0 - b7;
     }
     for (uint32_t i = 0; i < 8; ++i) {
-        const float g0 = intermediate[i * 8 + 0] * s0;
-        const float g1 = intermediate[i * 8 + 4] * s4;
-        const float g2 = intermediate[i * 8 + 2] * s2;
-        const float g3 = intermediate[i * 8 + 6] * s6;
-        const float g4 = intermediate[i * 8 + 5] * s5;
-        const float g5 = intermediate[i * 8 + 1] * s1;
-        const float g6 = intermediate[i * 8 + 7] * s7;
-        const float g7 = intermediate[i * 8 + 3] * s3;
+        const float g0 = intermediate[i * 8 + 0];
+        const float g1 = intermediate[i * 8 + 4];
+        const float g2 = intermediate[i * 8 + 2];
+        const float g3 = intermediate[i * 8 + 6];
+        const float g4 = intermediate[i * 8 + 5];
+        const float g5 = intermediate[i * 8 + 1];
+        const float g6 = intermediate[i * 8 + 7];
+        const float g7 = intermediate[i * 8 + 3];
 
         const float f0 = g0;
         const float f1 = g1;
@@ -1283,74 +2173,1243 @@ void inverseDCTBlockComponent(int* const component) {
         const float b6 = c6 - c7;
         const float b7 = c7;
 
-        component[i * 8 + 0] = b0 + b7 + 0.5f;
-        component[i * 8 + 1] = b1 + b6 + 0.5f;
-        component[i * 8 + 2] = b2 + b5 + 0.5f;
-        component[i * 8 + 3] = b3 + b4 + 0.5f;
-        component[i * 8 + 4] = b3 - b4 + 0.5f;
-        component[i * 8 + 5] = b2 - b5 + 0.5f;
-        component[i * 8 + 6] = b1 - b6 + 0.5f;
-        component[i * 8 + 7] = b0 - b7 + 0.5f;
+        component[i * 8 + 0] = (int)(b0 + b7 + 0.5f);
+        component[i * 8 + 1] = (int)(b1 + b6 + 0.5f);
+        component[i * 8 + 2] = (int)(b2 + b5 + 0.5f);
+        component[i * 8 + 3] = (int)(b3 + b4 + 0.5f);
+        component[i * 8 + 4] = (int)(b3 - b4 + 0.5f);
+        component[i * 8 + 5] = (int)(b2 - b5 + 0.5f);
+        component[i * 8 + 6] = (int)(b1 - b6 + 0.5f);
+        component[i * 8 + 7] = (int)(b0 - b7 + 0.5f);
     }
 }
 
-// perform IDCT on all MCUs
-void inverseDCT(const JPGImage* const image) {
-    for (uint32_t y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint32_t x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint32_t i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                for (uint32_t v = 0; v < component.verticalSamplingFactor; ++v) {
-                    for (uint32_t h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        inverseDCTBlockComponent(image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
-                    }
+// IDCT of a block whose only nonzero coefficient is the DC coefficient,
+//   which gives every sample the same value
+void inverseDCTBlockComponentDC(int16_t* const component, const float* const scaledTable) {
+    const int16_t value = (int)(component[0] * scaledTable[0] + 0.5f);
+    std::fill(component, component + 64, value);
+}
+
+// perform 1-D IDCT on 8 values of which only the first 4 may be nonzero
+//   this is the butterfly of inverseDCTBlockComponent without the
+//   operations on zeros, so the results match it exactly
+inline void inverseDCT1DSparse(const float x0, const float x1, const float x2, const float x3, float* const output, const uint32_t stride) {
+    const float g0 = x0;
+    const float g2 = x2;
+    const float g5 = x1;
+    const float g7 = x3;
+
+    const float f4 = -g7;
+    const float e5 = g5 - g7;
+    const float e7 = g5 + g7;
+    const float e8 = f4 + g5;
+
+    const float d2 = g2 * m1;
+    const float d4 = f4 * m2;
+    const float d5 = e5 * m3;
+    const float d6 = g5 * m4;
+    const float d8 = e8 * m5;
+
+    const float c2 = d2 - g2;
+    const float c4 = d4 + d8;
+    const float c5 = d5 + e7;
+    const float c6 = d6 - d8;
+    const float c8 = c5 - c6;
+
+    const float b0 = g0 + g2;
+    const float b1 = g0 + c2;
+    const float b2 = g0 - c2;
+    const float b3 = g0 - g2;
+    const float b4 = c4 - c8;
+    const float b6 = c6 - e7;
+
+    output[0 * stride] = b0 + e7;
+    output[1 * stride] = b1 + b6;
+    output[2 * stride] = b2 + c8;
+    output[3 * stride] = b3 + b4;
+    output[4 * stride] = b3 - b4;
+    output[5 * stride] = b2 - c8;
+    output[6 * stride] = b1 - b6;
+    output[7 * stride] = b0 - e7;
+}
+
+// IDCT of a block whose nonzero coefficients all lie in its top left
+//   4x4 corner, only columns 0-3 need a column pass and every pass has
+//   only 4 nonzero inputs
+void inverseDCTBlockComponent4x4(int16_t* const component, const float* const scaledTable) {
+    // the column pass results, 8 rows of the 4 columns
+    float intermediate[8 * 4];
+    for (uint32_t i = 0; i < 4; ++i) {
+        inverseDCT1DSparse(
+            component[0 * 8 + i] * scaledTable[0 * 8 + i],
+            component[1 * 8 + i] * scaledTable[1 * 8 + i],
+            component[2 * 8 + i] * scaledTable[2 * 8 + i],
+            component[3 * 8 + i] * scaledTable[3 * 8 + i],
+            intermediate + i,
+            4);
+    }
+    float output[64];
+    for (uint32_t i = 0; i < 8; ++i) {
+        inverseDCT1DSparse(
+            intermediate[i * 4 + 0],
+            intermediate[i * 4 + 1],
+            intermediate[i * 4 + 2],
+            intermediate[i * 4 + 3],
+            output + i * 8,
+            1);
+    }
+    for (uint32_t i = 0; i < 64; ++i) {
+        component[i] = (int)(output[i] + 0.5f);
+    }
+}
+
+// constants of the integer IDCT, fixed-point with 13 fractional bits
+const int integerIDCTBits = 13;
+// the column pass keeps 2 extra bits of precision for the row pass
+const int integerIDCTPass1Bits = 2;
+const int f0298 = 2446;  // 0.298631336
+const int f0390 = 3196;  // 0.390180644
+const int f0541 = 4433;  // 0.541196100
+const int f0765 = 6270;  // 0.765366865
+const int f0899 = 7373;  // 0.899976223
+const int f1175 = 9633;  // 1.175875602
+const int f1501 = 12299; // 1.501321110
+const int f1847 = 15137; // 1.847759065
+const int f1961 = 16069; // 1.961570560
+const int f2053 = 16819; // 2.053119869
+const int f2562 = 20995; // 2.562915447
+const int f3072 = 25172; // 3.072711026
+
+// perform 1-D integer IDCT on 8 values, dividing the results by
+//   2^shift with rounding
+// this is the slow but accurate Loeffler, Ligtenberg and Moschytz
+//   algorithm that libjpeg calls islow, it only needs 32-bit integers
+//   so its results do not depend on the compiler or CPU
+inline void inverseDCT1DInteger(const int* const input, const uint32_t inputStride, int* const output, const uint32_t outputStride, const int shift) {
+    // even part
+    const int z1 = (input[2 * inputStride] + input[6 * inputStride]) * f0541;
+    const int even2 = z1 - input[6 * inputStride] * f1847;
+    const int even3 = z1 + input[2 * inputStride] * f0765;
+    const int even0 = (input[0 * inputStride] + input[4 * inputStride]) * (1 << integerIDCTBits);
+    const int even1 = (input[0 * inputStride] - input[4 * inputStride]) * (1 << integerIDCTBits);
+
+    const int tmp10 = even0 + even3;
+    const int tmp13 = even0 - even3;
+    const int tmp11 = even1 + even2;
+    const int tmp12 = even1 - even2;
+
+    // odd part
+    const int x7 = input[7 * inputStride];
+    const int x5 = input[5 * inputStride];
+    const int x3 = input[3 * inputStride];
+    const int x1 = input[1 * inputStride];
+    const int z5 = (x7 + x3 + x5 + x1) * f1175;
+    const int z71 = (x7 + x1) * -f0899;
+    const int z53 = (x5 + x3) * -f2562;
+    const int z73 = (x7 + x3) * -f1961 + z5;
+    const int z51 = (x5 + x1) * -f0390 + z5;
+
+    const int odd0 = x7 * f0298 + z71 + z73;
+    const int odd1 = x5 * f2053 + z53 + z51;
+    const int odd2 = x3 * f3072 + z53 + z73;
+    const int odd3 = x1 * f1501 + z71 + z51;
+
+    const int round = 1 << (shift - 1);
+    output[0 * outputStride] = (tmp10 + odd3 + round) >> shift;
+    output[7 * outputStride] = (tmp10 - odd3 + round) >> shift;
+    output[1 * outputStride] = (tmp11 + odd2 + round) >> shift;
+    output[6 * outputStride] = (tmp11 - odd2 + round) >> shift;
+    output[2 * outputStride] = (tmp12 + odd1 + round) >> shift;
+    output[5 * outputStride] = (tmp12 - odd1 + round) >> shift;
+    output[3 * outputStride] = (tmp13 + odd0 + round) >> shift;
+    output[4 * outputStride] = (tmp13 - odd0 + round) >> shift;
+}
+
+// dequantize a block component and perform integer IDCT on all its
+//   columns and rows
+void inverseDCTBlockComponentInteger(int16_t* const component, const int16_t* const integerTable) {
+    int input[64];
+    for (uint32_t i = 0; i < 64; ++i) {
+        input[i] = component[i] * integerTable[i];
+    }
+    int intermediate[64];
+    for (uint32_t i = 0; i < 8; ++i) {
+        inverseDCT1DInteger(input + i, 8, intermediate + i, 8, integerIDCTBits - integerIDCTPass1Bits);
+    }
+    int output[64];
+    for (uint32_t i = 0; i < 8; ++i) {
+        // the 2-D IDCT also divides by 8
+        inverseDCT1DInteger(intermediate + i * 8, 1, output + i * 8, 1, integerIDCTBits + integerIDCTPass1Bits + 3);
+    }
+    for (uint32_t i = 0; i < 64; ++i) {
+        component[i] = output[i];
+    }
+}
+
+// integer IDCT of a block whose only nonzero coefficient is the DC
+//   coefficient, with the same rounding as inverseDCTBlockComponentInteger
+void inverseDCTBlockComponentIntegerDC(int16_t* const component, const int16_t* const integerTable) {
+    const int16_t value = (component[0] * integerTable[0] + 4) >> 3;
+    std::fill(component, component + 64, value);
+}
+
+#ifdef JPG_X86
+
+// CPU feature checks for picking SIMD kernels at runtime
+bool cpuSupportsSSE2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool cpuSupportsAVX2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    // the OS must also save the AVX registers on context switches
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// perform 1-D IDCT on 4 columns (or rows) at once, one per lane
+//   v[k] holds input k of every lane and receives output k
+//   the inputs must already be scaled, see scaleQuantizationTable
+TARGET_SSE2 inline void inverseDCT1DSSE2(__m128* const v) {
+    const __m128 g0 = v[0];
+    const __m128 g1 = v[4];
+    const __m128 g2 = v[2];
+    const __m128 g3 = v[6];
+    const __m128 g4 = v[5];
+    const __m128 g5 = v[1];
+    const __m128 g6 = v[7];
+    const __m128 g7 = v[3];
+
+    const __m128 f4 = _mm_sub_ps(g4, g7);
+    const __m128 f5 = _mm_add_ps(g5, g6);
+    const __m128 f6 = _mm_sub_ps(g5, g6);
+    const __m128 f7 = _mm_add_ps(g4, g7);
+
+    const __m128 e2 = _mm_sub_ps(g2, g3);
+    const __m128 e3 = _mm_add_ps(g2, g3);
+    const __m128 e5 = _mm_sub_ps(f5, f7);
+    const __m128 e7 = _mm_add_ps(f5, f7);
+    const __m128 e8 = _mm_add_ps(f4, f6);
+
+    const __m128 d2 = _mm_mul_ps(e2, _mm_set1_ps(m1));
+    const __m128 d4 = _mm_mul_ps(f4, _mm_set1_ps(m2));
+    const __m128 d5 = _mm_mul_ps(e5, _mm_set1_ps(m3));
+    const __m128 d6 = _mm_mul_ps(f6, _mm_set1_ps(m4));
+    const __m128 d8 = _mm_mul_ps(e8, _mm_set1_ps(m5));
+
+    const __m128 c0 = _mm_add_ps(g0, g1);
+    const __m128 c1 = _mm_sub_ps(g0, g1);
+    const __m128 c2 = _mm_sub_ps(d2, e3);
+    const __m128 c4 = _mm_add_ps(d4, d8);
+    const __m128 c5 = _mm_add_ps(d5, e7);
+    const __m128 c6 = _mm_sub_ps(d6, d8);
+    const __m128 c8 = _mm_sub_ps(c5, c6);
+
+    const __m128 b0 = _mm_add_ps(c0, e3);
+    const __m128 b1 = _mm_add_ps(c1, c2);
+    const __m128 b2 = _mm_sub_ps(c1, c2);
+    const __m128 b3 = _mm_sub_ps(c0, e3);
+    const __m128 b4 = _mm_sub_ps(c4, c8);
+    const __m128 b6 = _mm_sub_ps(c6, e7);
+
+    v[0] = _mm_add_ps(b0, e7);
+    v[1] = _mm_add_ps(b1, b6);
+    v[2] = _mm_add_ps(b2, c8);
+    v[3] = _mm_add_ps(b3, b4);
+    v[4] = _mm_sub_ps(b3, b4);
+    v[5] = _mm_sub_ps(b2, c8);
+    v[6] = _mm_sub_ps(b1, b6);
+    v[7] = _mm_sub_ps(b0, e7);
+}
+
+// perform 1-D IDCT on 4 columns (or rows) at once, one per lane, when
+//   only inputs 0-3 may be nonzero, see inverseDCT1DSparse
+TARGET_SSE2 inline void inverseDCT1DSparseSSE2(__m128* const v) {
+    const __m128 g0 = v[0];
+    const __m128 g2 = v[2];
+    const __m128 g5 = v[1];
+    const __m128 g7 = v[3];
+
+    const __m128 f4 = _mm_xor_ps(g7, _mm_set1_ps(-0.0f));
+    const __m128 e5 = _mm_sub_ps(g5, g7);
+    const __m128 e7 = _mm_add_ps(g5, g7);
+    const __m128 e8 = _mm_add_ps(f4, g5);
+
+    const __m128 d2 = _mm_mul_ps(g2, _mm_set1_ps(m1));
+    const __m128 d4 = _mm_mul_ps(f4, _mm_set1_ps(m2));
+    const __m128 d5 = _mm_mul_ps(e5, _mm_set1_ps(m3));
+    const __m128 d6 = _mm_mul_ps(g5, _mm_set1_ps(m4));
+    const __m128 d8 = _mm_mul_ps(e8, _mm_set1_ps(m5));
+
+    const __m128 c2 = _mm_sub_ps(d2, g2);
+    const __m128 c4 = _mm_add_ps(d4, d8);
+    const __m128 c5 = _mm_add_ps(d5, e7);
+    const __m128 c6 = _mm_sub_ps(d6, d8);
+    const __m128 c8 = _mm_sub_ps(c5, c6);
+
+    const __m128 b0 = _mm_add_ps(g0, g2);
+    const __m128 b1 = _mm_add_ps(g0, c2);
+    const __m128 b2 = _mm_sub_ps(g0, c2);
+    const __m128 b3 = _mm_sub_ps(g0, g2);
+    const __m128 b4 = _mm_sub_ps(c4, c8);
+    const __m128 b6 = _mm_sub_ps(c6, e7);
+
+    v[0] = _mm_add_ps(b0, e7);
+    v[1] = _mm_add_ps(b1, b6);
+    v[2] = _mm_add_ps(b2, c8);
+    v[3] = _mm_add_ps(b3, b4);
+    v[4] = _mm_sub_ps(b3, b4);
+    v[5] = _mm_sub_ps(b2, c8);
+    v[6] = _mm_sub_ps(b1, b6);
+    v[7] = _mm_sub_ps(b0, e7);
+}
+
+// transpose an 8x8 matrix held as left (columns 0-3) and right (columns 4-7) halves of rows
+TARGET_SSE2 inline void transpose8x8SSE2(__m128* const left, __m128* const right) {
+    __m128 topLeft[4] = { left[0], left[1], left[2], left[3] };
+    __m128 topRight[4] = { right[0], right[1], right[2], right[3] };
+    __m128 bottomLeft[4] = { left[4], left[5], left[6], left[7] };
+    __m128 bottomRight[4] = { right[4], right[5], right[6], right[7] };
+    _MM_TRANSPOSE4_PS(topLeft[0], topLeft[1], topLeft[2], topLeft[3]);
+    _MM_TRANSPOSE4_PS(topRight[0], topRight[1], topRight[2], topRight[3]);
+    _MM_TRANSPOSE4_PS(bottomLeft[0], bottomLeft[1], bottomLeft[2], bottomLeft[3]);
+    _MM_TRANSPOSE4_PS(bottomRight[0], bottomRight[1], bottomRight[2], bottomRight[3]);
+    for (uint32_t i = 0; i < 4; ++i) {
+        left[i] = topLeft[i];
+        left[i + 4] = topRight[i];
+        right[i] = bottomLeft[i];
+        right[i + 4] = bottomRight[i];
+    }
+}
+
+// SSE2 version of inverseDCTBlockComponent with bit-exact results
+//   each 1-D pass works on 4 columns (or rows) at a time
+TARGET_SSE2 void inverseDCTBlockComponentSSE2(int16_t* const component, const float* const scaledTable) {
+    __m128 left[8];
+    __m128 right[8];
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m128i row = _mm_loadu_si128((const __m128i*)(component + i * 8));
+        // sign-extend the 16-bit coefficients to 32 bits
+        left[i] = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16)),
+            _mm_loadu_ps(scaledTable + i * 8));
+        right[i] = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(row, row), 16)),
+            _mm_loadu_ps(scaledTable + i * 8 + 4));
+    }
+
+    inverseDCT1DSSE2(left);
+    inverseDCT1DSSE2(right);
+    transpose8x8SSE2(left, right);
+    inverseDCT1DSSE2(left);
+    inverseDCT1DSSE2(right);
+    transpose8x8SSE2(left, right);
+
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m128i lo = _mm_cvttps_epi32(_mm_add_ps(left[i], half));
+        const __m128i hi = _mm_cvttps_epi32(_mm_add_ps(right[i], half));
+        _mm_storeu_si128((__m128i*)(component + i * 8), _mm_packs_epi32(lo, hi));
+    }
+}
+
+// SSE2 version of inverseDCTBlockComponent4x4 with bit-exact results
+TARGET_SSE2 void inverseDCTBlockComponent4x4SSE2(int16_t* const component, const float* const scaledTable) {
+    __m128 left[8];
+    __m128 right[8];
+    for (uint32_t i = 0; i < 4; ++i) {
+        const __m128i row = _mm_loadl_epi64((const __m128i*)(component + i * 8));
+        // sign-extend the 16-bit coefficients to 32 bits
+        left[i] = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16)),
+            _mm_loadu_ps(scaledTable + i * 8));
+    }
+
+    // columns 4-7 stay zero, so after the transpose rows 4-7 do too
+    inverseDCT1DSparseSSE2(left);
+    for (uint32_t i = 0; i < 8; ++i) {
+        right[i] = _mm_setzero_ps();
+    }
+    transpose8x8SSE2(left, right);
+    inverseDCT1DSparseSSE2(left);
+    inverseDCT1DSparseSSE2(right);
+    transpose8x8SSE2(left, right);
+
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m128i lo = _mm_cvttps_epi32(_mm_add_ps(left[i], half));
+        const __m128i hi = _mm_cvttps_epi32(_mm_add_ps(right[i], half));
+        _mm_storeu_si128((__m128i*)(component + i * 8), _mm_packs_epi32(lo, hi));
+    }
+}
+
+// perform 1-D IDCT on 8 columns (or rows) at once, one per lane
+//   v[k] holds input k of every lane and receives output k
+//   the inputs must already be scaled, see scaleQuantizationTable
+TARGET_AVX2 inline void inverseDCT1DAVX2(__m256* const v) {
+    const __m256 g0 = v[0];
+    const __m256 g1 = v[4];
+    const __m256 g2 = v[2];
+    const __m256 g3 = v[6];
+    const __m256 g4 = v[5];
+    const __m256 g5 = v[1];
+    const __m256 g6 = v[7];
+    const __m256 g7 = v[3];
+
+    const __m256 f4 = _mm256_sub_ps(g4, g7);
+    const __m256 f5 = _mm256_add_ps(g5, g6);
+    const __m256 f6 = _mm256_sub_ps(g5, g6);
+    const __m256 f7 = _mm256_add_ps(g4, g7);
+
+    const __m256 e2 = _mm256_sub_ps(g2, g3);
+    const __m256 e3 = _mm256_add_ps(g2, g3);
+    const __m256 e5 = _mm256_sub_ps(f5, f7);
+    const __m256 e7 = _mm256_add_ps(f5, f7);
+    const __m256 e8 = _mm256_add_ps(f4, f6);
+
+    const __m256 d2 = _mm256_mul_ps(e2, _mm256_set1_ps(m1));
+    const __m256 d4 = _mm256_mul_ps(f4, _mm256_set1_ps(m2));
+    const __m256 d5 = _mm256_mul_ps(e5, _mm256_set1_ps(m3));
+    const __m256 d6 = _mm256_mul_ps(f6, _mm256_set1_ps(m4));
+    const __m256 d8 = _mm256_mul_ps(e8, _mm256_set1_ps(m5));
+
+    const __m256 c0 = _mm256_add_ps(g0, g1);
+    const __m256 c1 = _mm256_sub_ps(g0, g1);
+    const __m256 c2 = _mm256_sub_ps(d2, e3);
+    const __m256 c4 = _mm256_add_ps(d4, d8);
+    const __m256 c5 = _mm256_add_ps(d5, e7);
+    const __m256 c6 = _mm256_sub_ps(d6, d8);
+    const __m256 c8 = _mm256_sub_ps(c5, c6);
+
+    const __m256 b0 = _mm256_add_ps(c0, e3);
+    const __m256 b1 = _mm256_add_ps(c1, c2);
+    const __m256 b2 = _mm256_sub_ps(c1, c2);
+    const __m256 b3 = _mm256_sub_ps(c0, e3);
+    const __m256 b4 = _mm256_sub_ps(c4, c8);
+    const __m256 b6 = _mm256_sub_ps(c6, e7);
+
+    v[0] = _mm256_add_ps(b0, e7);
+    v[1] = _mm256_add_ps(b1, b6);
+    v[2] = _mm256_add_ps(b2, c8);
+    v[3] = _mm256_add_ps(b3, b4);
+    v[4] = _mm256_sub_ps(b3, b4);
+    v[5] = _mm256_sub_ps(b2, c8);
+    v[6] = _mm256_sub_ps(b1, b6);
+    v[7] = _mm256_sub_ps(b0, e7);
+}
+
+// perform 1-D IDCT on 8 columns (or rows) at once, one per lane, when
+//   only inputs 0-3 may be nonzero, see inverseDCT1DSparse
+TARGET_AVX2 inline void inverseDCT1DSparseAVX2(__m256* const v) {
+    const __m256 g0 = v[0];
+    const __m256 g2 = v[2];
+    const __m256 g5 = v[1];
+    const __m256 g7 = v[3];
+
+    const __m256 f4 = _mm256_xor_ps(g7, _mm256_set1_ps(-0.0f));
+    const __m256 e5 = _mm256_sub_ps(g5, g7);
+    const __m256 e7 = _mm256_add_ps(g5, g7);
+    const __m256 e8 = _mm256_add_ps(f4, g5);
+
+    const __m256 d2 = _mm256_mul_ps(g2, _mm256_set1_ps(m1));
+    const __m256 d4 = _mm256_mul_ps(f4, _mm256_set1_ps(m2));
+    const __m256 d5 = _mm256_mul_ps(e5, _mm256_set1_ps(m3));
+    const __m256 d6 = _mm256_mul_ps(g5, _mm256_set1_ps(m4));
+    const __m256 d8 = _mm256_mul_ps(e8, _mm256_set1_ps(m5));
+
+    const __m256 c2 = _mm256_sub_ps(d2, g2);
+    const __m256 c4 = _mm256_add_ps(d4, d8);
+    const __m256 c5 = _mm256_add_ps(d5, e7);
+    const __m256 c6 = _mm256_sub_ps(d6, d8);
+    const __m256 c8 = _mm256_sub_ps(c5, c6);
+
+    const __m256 b0 = _mm256_add_ps(g0, g2);
+    const __m256 b1 = _mm256_add_ps(g0, c2);
+    const __m256 b2 = _mm256_sub_ps(g0, c2);
+    const __m256 b3 = _mm256_sub_ps(g0, g2);
+    const __m256 b4 = _mm256_sub_ps(c4, c8);
+    const __m256 b6 = _mm256_sub_ps(c6, e7);
+
+    v[0] = _mm256_add_ps(b0, e7);
+    v[1] = _mm256_add_ps(b1, b6);
+    v[2] = _mm256_add_ps(b2, c8);
+    v[3] = _mm256_add_ps(b3, b4);
+    v[4] = _mm256_sub_ps(b3, b4);
+    v[5] = _mm256_sub_ps(b2, c8);
+    v[6] = _mm256_sub_ps(b1, b6);
+    v[7] = _mm256_sub_ps(b0, e7);
+}
+
+// transpose an 8x8 matrix held as 8 rows
+TARGET_AVX2 inline void transpose8x8AVX2(__m256* const v) {
+    const __m256 t0 = _mm256_unpacklo_ps(v[0], v[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(v[0], v[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(v[2], v[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(v[2], v[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(v[4], v[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(v[4], v[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(v[6], v[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(v[6], v[7]);
+    const __m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44);
+    const __m256 u1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    const __m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44);
+    const __m256 u3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    const __m256 u4 = _mm256_shuffle_ps(t4, t6, 0x44);
+    const __m256 u5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+    const __m256 u6 = _mm256_shuffle_ps(t5, t7, 0x44);
+    const __m256 u7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+    v[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    v[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    v[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    v[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    v[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    v[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    v[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    v[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+// AVX2 version of inverseDCTBlockComponent with bit-exact results
+//   each 1-D pass works on all 8 columns (or rows) at once
+TARGET_AVX2 void inverseDCTBlockComponentAVX2(int16_t* const component, const float* const scaledTable) {
+    __m256 v[8];
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m128i row = _mm_loadu_si128((const __m128i*)(component + i * 8));
+        v[i] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(row)), _mm256_loadu_ps(scaledTable + i * 8));
+    }
+
+    inverseDCT1DAVX2(v);
+    transpose8x8AVX2(v);
+    inverseDCT1DAVX2(v);
+    transpose8x8AVX2(v);
+
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m256i row = _mm256_cvttps_epi32(_mm256_add_ps(v[i], half));
+        const __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(row), _mm256_extracti128_si256(row, 1));
+        _mm_storeu_si128((__m128i*)(component + i * 8), packed);
+    }
+}
+
+// AVX2 version of inverseDCTBlockComponent4x4 with bit-exact results
+TARGET_AVX2 void inverseDCTBlockComponent4x4AVX2(int16_t* const component, const float* const scaledTable) {
+    __m256 v[8];
+    for (uint32_t i = 0; i < 4; ++i) {
+        const __m128i row = _mm_loadu_si128((const __m128i*)(component + i * 8));
+        v[i] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(row)), _mm256_loadu_ps(scaledTable + i * 8));
+    }
+
+    // columns 4-7 stay zero, so after the transpose rows 4-7 do too
+    inverseDCT1DSparseAVX2(v);
+    transpose8x8AVX2(v);
+    inverseDCT1DSparseAVX2(v);
+    transpose8x8AVX2(v);
+
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (uint32_t i = 0; i < 8; ++i) {
+        const __m256i row = _mm256_cvttps_epi32(_mm256_add_ps(v[i], half));
+        const __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(row), _mm256_extracti128_si256(row, 1));
+        _mm_storeu_si128((__m128i*)(component + i * 8), packed);
+    }
+}
+
+// multiply the interleaved 16-bit pairs (a, b) of lo and hi by the
+//   constants (ca, cb), giving 32-bit a * ca + b * cb in two registers
+TARGET_SSE2 inline void multiplyAddSSE2(const __m128i lo, const __m128i hi, const int16_t ca, const int16_t cb, __m128i* const output) {
+    const __m128i c = _mm_set1_epi32((int)((uint32_t)(uint16_t)ca | (uint32_t)(uint16_t)cb << 16));
+    output[0] = _mm_madd_epi16(lo, c);
+    output[1] = _mm_madd_epi16(hi, c);
+}
+
+// perform 1-D integer IDCT on 8 columns (or rows) at once, one per
+//   16-bit lane, with the results of inverseDCT1DInteger
+//   v[k] holds input k of every lane and receives output k
+// products and sums are 32-bit, only the inputs and outputs are 16-bit
+TARGET_SSE2 inline void inverseDCT1DIntegerSSE2(__m128i* const v, const int shift) {
+    // even part
+    __m128i even2[2];
+    __m128i even3[2];
+    const __m128i lo26 = _mm_unpacklo_epi16(v[2], v[6]);
+    const __m128i hi26 = _mm_unpackhi_epi16(v[2], v[6]);
+    multiplyAddSSE2(lo26, hi26, f0541 + f0765, f0541, even3);
+    multiplyAddSSE2(lo26, hi26, f0541, f0541 - f1847, even2);
+
+    // (x << 16) >> (16 - bits) sign-extends x and multiplies it by 2^bits
+    const __m128i sum04 = _mm_add_epi16(v[0], v[4]);
+    const __m128i difference04 = _mm_sub_epi16(v[0], v[4]);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i even0[2] = {
+        _mm_srai_epi32(_mm_unpacklo_epi16(zero, sum04), 16 - integerIDCTBits),
+        _mm_srai_epi32(_mm_unpackhi_epi16(zero, sum04), 16 - integerIDCTBits)
+    };
+    const __m128i even1[2] = {
+        _mm_srai_epi32(_mm_unpacklo_epi16(zero, difference04), 16 - integerIDCTBits),
+        _mm_srai_epi32(_mm_unpackhi_epi16(zero, difference04), 16 - integerIDCTBits)
+    };
+
+    // odd part, the multiplies by z5 and the sums it is shared by are
+    //   folded into the constants
+    __m128i z73[2];
+    __m128i z51[2];
+    const __m128i sum73 = _mm_add_epi16(v[7], v[3]);
+    const __m128i sum51 = _mm_add_epi16(v[5], v[1]);
+    const __m128i lo7351 = _mm_unpacklo_epi16(sum73, sum51);
+    const __m128i hi7351 = _mm_unpackhi_epi16(sum73, sum51);
+    multiplyAddSSE2(lo7351, hi7351, f1175 - f1961, f1175, z73);
+    multiplyAddSSE2(lo7351, hi7351, f1175, f1175 - f0390, z51);
+
+    __m128i odd0[2];
+    __m128i odd1[2];
+    __m128i odd2[2];
+    __m128i odd3[2];
+    const __m128i lo71 = _mm_unpacklo_epi16(v[7], v[1]);
+    const __m128i hi71 = _mm_unpackhi_epi16(v[7], v[1]);
+    const __m128i lo53 = _mm_unpacklo_epi16(v[5], v[3]);
+    const __m128i hi53 = _mm_unpackhi_epi16(v[5], v[3]);
+    multiplyAddSSE2(lo71, hi71, f0298 - f0899, -f0899, odd0);
+    multiplyAddSSE2(lo71, hi71, -f0899, f1501 - f0899, odd3);
+    multiplyAddSSE2(lo53, hi53, f2053 - f2562, -f2562, odd1);
+    multiplyAddSSE2(lo53, hi53, -f2562, f3072 - f2562, odd2);
+
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    __m128i output[8][2];
+    for (uint32_t i = 0; i < 2; ++i) {
+        odd0[i] = _mm_add_epi32(odd0[i], z73[i]);
+        odd1[i] = _mm_add_epi32(odd1[i], z51[i]);
+        odd2[i] = _mm_add_epi32(odd2[i], z73[i]);
+        odd3[i] = _mm_add_epi32(odd3[i], z51[i]);
+
+        const __m128i tmp10 = _mm_add_epi32(_mm_add_epi32(even0[i], even3[i]), round);
+        const __m128i tmp13 = _mm_add_epi32(_mm_sub_epi32(even0[i], even3[i]), round);
+        const __m128i tmp11 = _mm_add_epi32(_mm_add_epi32(even1[i], even2[i]), round);
+        const __m128i tmp12 = _mm_add_epi32(_mm_sub_epi32(even1[i], even2[i]), round);
+
+        output[0][i] = _mm_sra_epi32(_mm_add_epi32(tmp10, odd3[i]), _mm_cvtsi32_si128(shift));
+        output[7][i] = _mm_sra_epi32(_mm_sub_epi32(tmp10, odd3[i]), _mm_cvtsi32_si128(shift));
+        output[1][i] = _mm_sra_epi32(_mm_add_epi32(tmp11, odd2[i]), _mm_cvtsi32_si128(shift));
+        output[6][i] = _mm_sra_epi32(_mm_sub_epi32(tmp11, odd2[i]), _mm_cvtsi32_si128(shift));
+        output[2][i] = _mm_sra_epi32(_mm_add_epi32(tmp12, odd1[i]), _mm_cvtsi32_si128(shift));
+        output[5][i] = _mm_sra_epi32(_mm_sub_epi32(tmp12, odd1[i]), _mm_cvtsi32_si128(shift));
+        output[3][i] = _mm_sra_epi32(_mm_add_epi32(tmp13, odd0[i]), _mm_cvtsi32_si128(shift));
+        output[4][i] = _mm_sra_epi32(_mm_sub_epi32(tmp13, odd0[i]), _mm_cvtsi32_si128(shift));
+    }
+    for (uint32_t i = 0; i < 8; ++i) {
+        v[i] = _mm_packs_epi32(output[i][0], output[i][1]);
+    }
+}
+
+// transpose an 8x8 matrix of 16-bit values, one row per register
+TARGET_SSE2 inline void transpose8x8Integer16SSE2(__m128i* const v) {
+    const __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+    const __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    const __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+    const __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    const __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+    const __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    const __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+    const __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+
+    const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm_unpacklo_epi64(b0, b4);
+    v[1] = _mm_unpackhi_epi64(b0, b4);
+    v[2] = _mm_unpacklo_epi64(b1, b5);
+    v[3] = _mm_unpackhi_epi64(b1, b5);
+    v[4] = _mm_unpacklo_epi64(b2, b6);
+    v[5] = _mm_unpackhi_epi64(b2, b6);
+    v[6] = _mm_unpacklo_epi64(b3, b7);
+    v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// SSE2 version of inverseDCTBlockComponentInteger with bit-exact
+//   results for coefficients that fit in 16 bits once dequantized,
+//   which all valid 8-bit JPGs have
+//   each 1-D pass works on all 8 columns (or rows) at a time
+TARGET_SSE2 void inverseDCTBlockComponentIntegerSSE2(int16_t* const component, const int16_t* const integerTable) {
+    __m128i v[8];
+    for (uint32_t i = 0; i < 8; ++i) {
+        v[i] = _mm_mullo_epi16(
+            _mm_loadu_si128((const __m128i*)(component + i * 8)),
+            _mm_loadu_si128((const __m128i*)(integerTable + i * 8)));
+    }
+
+    inverseDCT1DIntegerSSE2(v, integerIDCTBits - integerIDCTPass1Bits);
+    transpose8x8Integer16SSE2(v);
+    // the 2-D IDCT also divides by 8
+    inverseDCT1DIntegerSSE2(v, integerIDCTBits + integerIDCTPass1Bits + 3);
+    transpose8x8Integer16SSE2(v);
+
+    for (uint32_t i = 0; i < 8; ++i) {
+        _mm_storeu_si128((__m128i*)(component + i * 8), v[i]);
+    }
+}
+
+#endif
+
+typedef void (*InverseDCTFunction)(int16_t* const component, const float* const scaledTable);
+
+// pick the fastest IDCT kernel the CPU supports
+InverseDCTFunction selectInverseDCT() {
+#ifdef JPG_X86
+    if (cpuSupportsAVX2()) {
+        return inverseDCTBlockComponentAVX2;
+    }
+    if (cpuSupportsSSE2()) {
+        return inverseDCTBlockComponentSSE2;
+    }
+#endif
+    return inverseDCTBlockComponent;
+}
+
+const InverseDCTFunction inverseDCTBlockComponentBest = selectInverseDCT();
+
+// pick the fastest 4x4 IDCT kernel the CPU supports
+InverseDCTFunction selectInverseDCT4x4() {
+#ifdef JPG_X86
+    if (cpuSupportsAVX2()) {
+        return inverseDCTBlockComponent4x4AVX2;
+    }
+    if (cpuSupportsSSE2()) {
+        return inverseDCTBlockComponent4x4SSE2;
+    }
+#endif
+    return inverseDCTBlockComponent4x4;
+}
+
+const InverseDCTFunction inverseDCTBlockComponent4x4Best = selectInverseDCT4x4();
+
+// build the matrix of the size-point IDCT used to decode at 8/size of
+//   the full size, entry x * size + u holds C(u) / 2 * cos((2x + 1)u pi / 2size)
+// the top left size x size coefficients of a block then give the block
+//   shrunk by 8/size, with the same scaling as the 8-point IDCT
+std::vector<float> makeScaledInverseDCTMatrix(const uint32_t size) {
+    std::vector<float> matrix(size * size);
+    for (uint32_t x = 0; x < size; ++x) {
+        for (uint32_t u = 0; u < size; ++u) {
+            const double c = u == 0 ? 1.0 / std::sqrt(2.0) : 1.0;
+            matrix[x * size + u] = (float)(c / 2.0 * std::cos((2.0 * x + 1.0) * u * M_PI / (2.0 * size)));
+        }
+    }
+    return matrix;
+}
+
+const std::vector<float> scaledInverseDCTMatrix1 = makeScaledInverseDCTMatrix(1);
+const std::vector<float> scaledInverseDCTMatrix2 = makeScaledInverseDCTMatrix(2);
+const std::vector<float> scaledInverseDCTMatrix4 = makeScaledInverseDCTMatrix(4);
+
+// dequantize a block component and perform a size x size IDCT on its
+//   top left coefficients, size being 1, 2 or 4
+// the samples are left in the top left corner of the block
+void inverseDCTBlockComponentScaled(int16_t* const component, const QuantizationTable& qTable, const uint32_t size) {
+    const float* const matrix =
+        size == 1 ? scaledInverseDCTMatrix1.data() :
+        size == 2 ? scaledInverseDCTMatrix2.data() :
+        scaledInverseDCTMatrix4.data();
+
+    float intermediate[16];
+    for (uint32_t v = 0; v < size; ++v) {
+        for (uint32_t x = 0; x < size; ++x) {
+            float sum = 0.0f;
+            for (uint32_t u = 0; u < size; ++u) {
+                sum += matrix[x * size + u] * (component[v * 8 + u] * (float)qTable.table[v * 8 + u]);
+            }
+            intermediate[v * size + x] = sum;
+        }
+    }
+    for (uint32_t y = 0; y < size; ++y) {
+        for (uint32_t x = 0; x < size; ++x) {
+            float sum = 0.0f;
+            for (uint32_t v = 0; v < size; ++v) {
+                sum += matrix[y * size + v] * intermediate[v * size + x];
+            }
+            component[y * 8 + x] = (int)(sum + 0.5f);
+        }
+    }
+}
+
+typedef void (*IntegerInverseDCTFunction)(int16_t* const component, const int16_t* const integerTable);
+
+// pick the fastest integer IDCT kernel the CPU supports
+IntegerInverseDCTFunction selectIntegerInverseDCT() {
+#ifdef JPG_X86
+    if (cpuSupportsSSE2()) {
+        return inverseDCTBlockComponentIntegerSSE2;
+    }
+#endif
+    return inverseDCTBlockComponentInteger;
+}
+
+const IntegerInverseDCTFunction inverseDCTBlockComponentIntegerBest = selectIntegerInverseDCT();
+
+// pick the cheapest IDCT for a block from the zig-zag index of its
+//   last nonzero coefficient
+InverseDCTFunction selectInverseDCT(const byte lastNonzero) {
+    if (lastNonzero == 0) {
+        return inverseDCTBlockComponentDC;
+    }
+    // zig-zag indices 0-9 all lie in the top left 4x4 corner
+    if (lastNonzero <= 9) {
+        return inverseDCTBlockComponent4x4Best;
+    }
+    return inverseDCTBlockComponentBest;
+}
+
+// pick the cheapest integer IDCT for a block from the zig-zag index of
+//   its last nonzero coefficient
+IntegerInverseDCTFunction selectIntegerInverseDCT(const byte lastNonzero) {
+    if (lastNonzero == 0) {
+        return inverseDCTBlockComponentIntegerDC;
+    }
+    return inverseDCTBlockComponentIntegerBest;
+}
+
+// dequantize and perform IDCT on all blocks of one MCU row
+void inverseDCTMCURow(const JPGImage* const image, const uint32_t mcuRow) {
+    for (uint32_t i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        const QuantizationTable& qTable = image->quantizationTables[component.quantizationTableID];
+        const uint32_t v = component.verticalSamplingFactor;
+        const uint32_t h = component.horizontalSamplingFactor;
+        for (uint32_t blockRow = mcuRow * v; blockRow < (mcuRow + 1) * v; ++blockRow) {
+            for (uint32_t blockColumn = image->firstMCUColumn * h; blockColumn < image->endMCUColumn * h; ++blockColumn) {
+                const uint32_t blockIndex = getBlockIndex(component, blockRow, blockColumn);
+                int16_t* const block = component.blocks + blockIndex * 64;
+                if (image->scale != 1) {
+                    inverseDCTBlockComponentScaled(block, qTable, 8 / image->scale);
+                }
+                else if (image->integerIDCT) {
+                    selectIntegerInverseDCT(component.lastNonzero[blockIndex])(block, qTable.integerTable);
+                }
+                else {
+                    selectInverseDCT(component.lastNonzero[blockIndex])(block, qTable.scaledTable);
                 }
             }
         }
     }
 }
 
-// convert all pixels in a block from YCbCr color space to RGB
-void YCbCrToRGBBlock(Block& yBlock, const Block& cbcrBlock, const uint32_t vSamp, const uint32_t hSamp, const uint32_t v, const uint32_t h) {
-    for (uint32_t y = 7; y < 8; --y) {
-        for (uint32_t x = 7; x < 8; --x) {
-            const uint32_t pixel = y * 8 + x;
-            const uint32_t cbcrPixelRow = y / vSamp + 4 * v;
-            const uint32_t cbcrPixelColumn = x / hSamp + 4 * h;
-            const uint32_t cbcrPixel = cbcrPixelRow * 8 + cbcrPixelColumn;
-            int r = yBlock.y[pixel] + 1.402f * cbcrBlock.cr[cbcrPixel] + 128;
-            int g = yBlock.y[pixel] - 0.344f * cbcrBlock.cb[cbcrPixel] - 0.714f * cbcrBlock.cr[cbcrPixel] + 128;
-            int b = yBlock.y[pixel] + 1.772f * cbcrBlock.cb[cbcrPixel] + 128;
-            if (r < 0)   r = 0;
-            if (r > 255) r = 255;
-            if (g < 0)   g = 0;
-            if (g > 255) g = 255;
-            if (b < 0)   b = 0;
-            if (b > 255) b = 255;
-            yBlock.r[pixel] = r;
-            yBlock.g[pixel] = g;
-            yBlock.b[pixel] = b;
+// dequantize and perform IDCT on all MCUs that overlap the output, in
+//   parallel on threadPool if it is not null
+void inverseDCT(const JPGImage* const image, ThreadPool* const threadPool) {
+    parallelForMCURows(image->endMCURow - image->firstMCURow, threadPool, [&](const uint32_t i) {
+        inverseDCTMCURow(image, image->firstMCURow + i);
+    });
+}
+
+// fixed-point color conversion constants, with 14 fractional bits
+const int colorBits = 14;
+const int crToR = 22970;  // 1.402
+const int cbToG = -5638;  // -0.344136
+const int crToG = -11700; // -0.714136
+const int cbToB = 29032;  // 1.772
+
+inline byte clampToByte(const int value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// convert a row of count pixels from YCbCr color space to RGB, stored
+//   in format
+//   the samples are centered on 0 as the IDCT leaves them, and the
+//   chrominance rows are already upsampled to one sample per pixel
+//   grayscale output only needs the luminance row
+void YCbCrToRGBRow(const int16_t* const yRow, const int16_t* const cbRow, const int16_t* const crRow, byte* const pixels, const uint32_t count, const PixelFormat format) {
+    if (format == PixelFormat::GRAY) {
+        for (uint32_t i = 0; i < count; ++i) {
+            pixels[i] = clampToByte(yRow[i] + 128);
+        }
+        return;
+    }
+    const uint32_t bytesPerPixel = getBytesPerPixel(format);
+    const uint32_t red = format == PixelFormat::BGR ? 2 : 0;
+    const uint32_t blue = 2 - red;
+    const int round = 1 << (colorBits - 1);
+    for (uint32_t i = 0; i < count; ++i) {
+        const int y = yRow[i] + 128;
+        const int cb = cbRow[i];
+        const int cr = crRow[i];
+        byte* const pixel = pixels + i * bytesPerPixel;
+        pixel[red] = clampToByte(y + ((cr * crToR + round) >> colorBits));
+        pixel[1] = clampToByte(y + ((cb * cbToG + cr * crToG + round) >> colorBits));
+        pixel[blue] = clampToByte(y + ((cb * cbToB + round) >> colorBits));
+        if (bytesPerPixel == 4) {
+            pixel[3] = 255;
+        }
+    }
+}
+
+#ifdef JPG_X86
+
+// compute (a * ca + b * cb + round) >> colorBits for 8 interleaved
+//   pairs of 16-bit values (a, b) in lo and hi, as 16-bit values
+TARGET_SSE2 inline __m128i colorOffsetSSE2(const __m128i lo, const __m128i hi, const int16_t ca, const int16_t cb) {
+    const __m128i c = _mm_set1_epi32((int)((uint32_t)(uint16_t)ca | (uint32_t)(uint16_t)cb << 16));
+    const __m128i round = _mm_set1_epi32(1 << (colorBits - 1));
+    return _mm_packs_epi32(
+        _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, c), round), colorBits),
+        _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, c), round), colorBits));
+}
+
+// pack 4 pixels stored as 4 bytes each into the low 12 bytes, dropping
+//   every fourth byte
+TARGET_SSE2 inline __m128i packRGBSSE2(const __m128i rgb0) {
+    // close the gap within each 64-bit half, then between the halves
+    const __m128i halves = _mm_or_si128(
+        _mm_and_si128(rgb0, _mm_set1_epi64x(0x0000000000FFFFFF)),
+        _mm_and_si128(_mm_srli_epi64(rgb0, 8), _mm_set1_epi64x(0x0000FFFFFF000000)));
+    return _mm_or_si128(
+        _mm_and_si128(halves, _mm_set_epi64x(0, -1)),
+        _mm_srli_si128(_mm_and_si128(halves, _mm_set_epi64x(-1, 0)), 2));
+}
+
+// SSE2 version of YCbCrToRGBRow with bit-exact results
+//   each iteration converts 16 pixels, saturating packs do the clamping
+TARGET_SSE2 void YCbCrToRGBRowSSE2(const int16_t* const yRow, const int16_t* const cbRow, const int16_t* const crRow, byte* const pixels, const uint32_t count, const PixelFormat format) {
+    const __m128i offset = _mm_set1_epi16(128);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    if (format == PixelFormat::GRAY) {
+        for (; i + 16 <= count; i += 16) {
+            const __m128i y0 = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(yRow + i)), offset);
+            const __m128i y1 = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(yRow + i + 8)), offset);
+            _mm_storeu_si128((__m128i*)(pixels + i), _mm_packus_epi16(y0, y1));
+        }
+        YCbCrToRGBRow(yRow + i, cbRow + i, crRow + i, pixels + i, count - i, format);
+        return;
+    }
+    const uint32_t bytesPerPixel = getBytesPerPixel(format);
+    for (; i + 16 <= count; i += 16) {
+        __m128i rgb[3][2];
+        for (uint32_t k = 0; k < 2; ++k) {
+            const __m128i y = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(yRow + i + k * 8)), offset);
+            const __m128i cb = _mm_loadu_si128((const __m128i*)(cbRow + i + k * 8));
+            const __m128i cr = _mm_loadu_si128((const __m128i*)(crRow + i + k * 8));
+            const __m128i lo = _mm_unpacklo_epi16(cb, cr);
+            const __m128i hi = _mm_unpackhi_epi16(cb, cr);
+            rgb[0][k] = _mm_adds_epi16(y, colorOffsetSSE2(lo, hi, 0, crToR));
+            rgb[1][k] = _mm_adds_epi16(y, colorOffsetSSE2(lo, hi, cbToG, crToG));
+            rgb[2][k] = _mm_adds_epi16(y, colorOffsetSSE2(lo, hi, cbToB, 0));
+        }
+        const __m128i r = _mm_packus_epi16(rgb[0][0], rgb[0][1]);
+        const __m128i g = _mm_packus_epi16(rgb[1][0], rgb[1][1]);
+        const __m128i b = _mm_packus_epi16(rgb[2][0], rgb[2][1]);
+
+        // interleave to 4-byte pixels, 4 per register, whose last byte is
+        //   alpha for RGBA and otherwise zero and squeezed out
+        const __m128i first = format == PixelFormat::BGR ? b : r;
+        const __m128i third = format == PixelFormat::BGR ? r : b;
+        const __m128i fourth = format == PixelFormat::RGBA ? _mm_set1_epi8(-1) : zero;
+        const __m128i lo01 = _mm_unpacklo_epi8(first, g);
+        const __m128i hi01 = _mm_unpackhi_epi8(first, g);
+        const __m128i lo23 = _mm_unpacklo_epi8(third, fourth);
+        const __m128i hi23 = _mm_unpackhi_epi8(third, fourth);
+        const __m128i p[4] = {
+            _mm_unpacklo_epi16(lo01, lo23),
+            _mm_unpackhi_epi16(lo01, lo23),
+            _mm_unpacklo_epi16(hi01, hi23),
+            _mm_unpackhi_epi16(hi01, hi23)
+        };
+        byte* const out = pixels + i * bytesPerPixel;
+        if (bytesPerPixel == 4) {
+            for (uint32_t k = 0; k < 4; ++k) {
+                _mm_storeu_si128((__m128i*)(out + k * 16), p[k]);
+            }
+            continue;
         }
+        const __m128i p0 = packRGBSSE2(p[0]);
+        const __m128i p1 = packRGBSSE2(p[1]);
+        const __m128i p2 = packRGBSSE2(p[2]);
+        const __m128i p3 = packRGBSSE2(p[3]);
+        _mm_storeu_si128((__m128i*)(out + 0), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
     }
+    YCbCrToRGBRow(yRow + i, cbRow + i, crRow + i, pixels + i * bytesPerPixel, count - i, format);
 }
 
-// convert all pixels from YCbCr color space to RGB
-void YCbCrToRGB(const JPGImage* const image) {
+#endif
+
+typedef void (*ColorConversionFunction)(const int16_t* const yRow, const int16_t* const cbRow, const int16_t* const crRow, byte* const pixels, const uint32_t count, const PixelFormat format);
+
+// pick the fastest color conversion kernel the CPU supports
+ColorConversionFunction selectYCbCrToRGBRow() {
+#ifdef JPG_X86
+    if (cpuSupportsSSE2()) {
+        return YCbCrToRGBRowSSE2;
+    }
+#endif
+    return YCbCrToRGBRow;
+}
+
+const ColorConversionFunction YCbCrToRGBRowBest = selectYCbCrToRGBRow();
+
+// copy sample row pixelRow of the blocks in block row blockRow that lie
+//   in the MCU columns being converted into row, size samples per block
+void gatherSampleRow(const JPGImage* const image, const ColorComponent& component, const uint32_t blockRow, const uint32_t pixelRow, int16_t* const row) {
+    const uint32_t size = 8 / image->scale;
+    const uint32_t firstBlockColumn = image->firstMCUColumn * component.horizontalSamplingFactor;
+    const uint32_t endBlockColumn = image->endMCUColumn * component.horizontalSamplingFactor;
+    for (uint32_t blockColumn = firstBlockColumn; blockColumn < endBlockColumn; ++blockColumn) {
+        const int16_t* const samples = component.blocks + getBlockIndex(component, blockRow, blockColumn) * 64 + pixelRow * 8;
+        std::copy(samples, samples + size, row + (blockColumn - firstBlockColumn) * size);
+    }
+}
+
+// upsample a row of width chrominance samples to 2 * width by
+//   repeating each sample
+void upsampleRowSimple(const int16_t* const input, int16_t* const output, const uint32_t width) {
+    for (uint32_t i = 0; i < width; ++i) {
+        output[i * 2 + 0] = input[i];
+        output[i * 2 + 1] = input[i];
+    }
+}
+
+// fancy upsampling, like libjpeg's, places each chrominance sample
+//   between the luminance samples it covers and interpolates linearly,
+//   so every output sample is 3/4 of the nearer input sample plus 1/4 of
+//   the further one in each upsampled direction
+// the edges of the row repeat the outermost samples
+// the rounding alternates between neighbors so that it does not bias
+//   the output up or down
+
+// upsample a row of width samples horizontally to 2 * width samples
+void upsampleRowFancyH2V1(const int16_t* const input, int16_t* const output, const uint32_t width) {
+    for (uint32_t i = 0; i < width; ++i) {
+        const int nearer = input[i] * 3;
+        const int left = input[i > 0 ? i - 1 : 0];
+        const int right = input[i + 1 < width ? i + 1 : i];
+        output[i * 2 + 0] = (nearer + left + 1) >> 2;
+        output[i * 2 + 1] = (nearer + right + 2) >> 2;
+    }
+}
+
+// upsample vertically, giving the output row between the row of nearer
+//   samples and the row of further ones
+//   upper selects the rounding of the upper of the two output rows
+void upsampleRowFancyH1V2(const int16_t* const nearer, const int16_t* const further, int16_t* const output, const uint32_t width, const bool upper) {
+    const int round = upper ? 1 : 2;
+    for (uint32_t i = 0; i < width; ++i) {
+        output[i] = (nearer[i] * 3 + further[i] + round) >> 2;
+    }
+}
+
+// upsample both ways, giving 2 * width samples on the output row between
+//   the row of nearer samples and the row of further ones
+//   columnSums is scratch space for width samples
+void upsampleRowFancyH2V2(const int16_t* const nearer, const int16_t* const further, int16_t* const output, const uint32_t width, int* const columnSums) {
+    for (uint32_t i = 0; i < width; ++i) {
+        columnSums[i] = nearer[i] * 3 + further[i];
+    }
+    for (uint32_t i = 0; i < width; ++i) {
+        const int nearerSum = columnSums[i] * 3;
+        const int left = columnSums[i > 0 ? i - 1 : 0];
+        const int right = columnSums[i + 1 < width ? i + 1 : i];
+        output[i * 2 + 0] = (nearerSum + left + 8) >> 4;
+        output[i * 2 + 1] = (nearerSum + right + 7) >> 4;
+    }
+}
+
+// convert the pixels of one MCU row from YCbCr color space to the
+//   image's pixel format
+//   pixels points to the first output pixel of the MCU row, and rows
+//   are stride bytes apart
+// each output row is gathered from the blocks into rows of samples,
+//   with the chrominance upsampled to one sample per pixel, and then
+//   converted in one go
+// fancy upsampling interpolates across block edges, with the MCU rows
+//   above and below when they are held, so those must be transformed
+void YCbCrToRGBMCURow(const JPGImage* const image, const uint32_t mcuRow, byte* const pixels, const size_t stride) {
     const uint32_t vSamp = image->verticalSamplingFactor;
     const uint32_t hSamp = image->horizontalSamplingFactor;
-    for (uint32_t y = 0; y < image->blockHeight; y += vSamp) {
-        for (uint32_t x = 0; x < image->blockWidth; x += hSamp) {
-            const Block& cbcrBlock = image->blocks[y * image->blockWidthReal + x];
-            for (uint32_t v = vSamp - 1; v < vSamp; --v) {
-                for (uint32_t h = hSamp - 1; h < hSamp; --h) {
-                    Block& yBlock = image->blocks[(y + v) * image->blockWidthReal + (x + h)];
-                    YCbCrToRGBBlock(yBlock, cbcrBlock, vSamp, hSamp, v, h);
-                }
+    const uint32_t size = 8 / image->scale;
+    // grayscale output ignores the chrominance
+    const uint32_t numComponents = image->pixelFormat == PixelFormat::GRAY ? 1 : image->numComponents;
+    const ColorComponent& yComponent = image->colorComponents[0];
+
+    // the rows cover the MCU columns being converted, starting rowLeft
+    //   pixels to the left of the output
+    const uint32_t mcuWidth = hSamp * size;
+    const uint32_t rowWidth = (image->endMCUColumn - image->firstMCUColumn) * mcuWidth;
+    const uint32_t rowLeft = image->outputX - image->firstMCUColumn * mcuWidth;
+    const uint32_t cbcrWidth = rowWidth / hSamp;
+    // the scratch rows belong to the thread, so they are only allocated
+    //   when a wider row than before is converted
+    thread_local std::vector<int16_t> rows;
+    thread_local std::vector<int> columnSums;
+    rows.assign(rowWidth * 3 + cbcrWidth * 2, 0);
+    columnSums.resize(cbcrWidth);
+    int16_t* const yRow = rows.data();
+    int16_t* const cbcrRows[2] = { yRow + rowWidth, yRow + rowWidth * 2 };
+    int16_t* const nearerRow = yRow + rowWidth * 3;
+    int16_t* const furtherRow = nearerRow + cbcrWidth;
+
+    uint32_t firstRow = 0;
+    uint32_t numRows = 0;
+    getOutputRows(image, mcuRow, 1, firstRow, numRows);
+    for (uint32_t row = firstRow; row < firstRow + numRows; ++row) {
+        // position of the row within the MCU row
+        const uint32_t mcuPixelRow = image->outputY + row - mcuRow * vSamp * size;
+        gatherSampleRow(image, yComponent, mcuRow * vSamp + mcuPixelRow / size, mcuPixelRow % size, yRow);
+
+        // grayscale images have no chrominance planes, their
+        //   chrominance rows stay zero
+        for (uint32_t i = 1; i < numComponents; ++i) {
+            const ColorComponent& component = image->colorComponents[i];
+            int16_t* const cbcrRow = cbcrRows[i - 1];
+            const uint32_t cbcrPixelRow = mcuPixelRow / vSamp;
+            const bool interpolateVertically = image->fancyUpsampling && vSamp > 1;
+            if (hSamp == 1 && !interpolateVertically) {
+                gatherSampleRow(image, component, mcuRow, cbcrPixelRow, cbcrRow);
+                continue;
+            }
+            gatherSampleRow(image, component, mcuRow, cbcrPixelRow, nearerRow);
+            if (!image->fancyUpsampling) {
+                upsampleRowSimple(nearerRow, cbcrRow, cbcrWidth);
+                continue;
+            }
+            if (vSamp == 1) {
+                upsampleRowFancyH2V1(nearerRow, cbcrRow, cbcrWidth);
+                continue;
+            }
+
+            // the further row is above the output row's chrominance row
+            //   for the upper of the two output rows it covers, and below
+            //   it for the lower one, the MCU row's own edge row stands in
+            //   when the neighboring MCU row is not held
+            const bool upper = mcuPixelRow % 2 == 0;
+            uint32_t furtherMCURow = mcuRow;
+            uint32_t furtherPixelRow = cbcrPixelRow;
+            if (upper && cbcrPixelRow > 0) {
+                furtherPixelRow = cbcrPixelRow - 1;
+            }
+            else if (upper && mcuRow > image->firstMCURow) {
+                furtherMCURow = mcuRow - 1;
+                furtherPixelRow = size - 1;
+            }
+            else if (!upper && cbcrPixelRow + 1 < size) {
+                furtherPixelRow = cbcrPixelRow + 1;
+            }
+            else if (!upper && mcuRow + 1 < image->endMCURow) {
+                furtherMCURow = mcuRow + 1;
+                furtherPixelRow = 0;
+            }
+            gatherSampleRow(image, component, furtherMCURow, furtherPixelRow, furtherRow);
+            if (hSamp == 1) {
+                upsampleRowFancyH1V2(nearerRow, furtherRow, cbcrRow, cbcrWidth, upper);
+            }
+            else {
+                upsampleRowFancyH2V2(nearerRow, furtherRow, cbcrRow, cbcrWidth, columnSums.data());
             }
         }
+        YCbCrToRGBRowBest(yRow + rowLeft, cbcrRows[0] + rowLeft, cbcrRows[1] + rowLeft,
+            pixels + (row - firstRow) * stride, image->outputWidth, image->pixelFormat);
     }
 }
 
+// convert all pixels from YCbCr color space to the image's pixel format
+//   into a caller's buffer, in parallel on threadPool if it is not null
+// the buffer holds outputHeight rows that are stride bytes apart
+void YCbCrToRGB(const JPGImage* const image, ThreadPool* const threadPool, byte* const pixels, const size_t stride) {
+    parallelForMCURows(image->endMCURow - image->firstMCURow, threadPool, [&](const uint32_t i) {
+        uint32_t firstRow = 0;
+        uint32_t numRows = 0;
+        getOutputRows(image, image->firstMCURow + i, 1, firstRow, numRows);
+        YCbCrToRGBMCURow(image, image->firstMCURow + i, pixels + firstRow * stride, stride);
+    });
+}
+
+// convert all pixels from YCbCr color space to the image's pixel format
+//   into the image's own pixels, in parallel on threadPool if it is not null
+void YCbCrToRGB(JPGImage* const image, ThreadPool* const threadPool) {
+    const size_t stride = (size_t)image->outputWidth * getBytesPerPixel(image->pixelFormat);
+    image->pixels = allocateBuffer<byte>(image, image->outputHeight * stride);
+    if (image->pixels == nullptr) {
+        setError(image, DecodeError::OutOfMemory, "Memory error");
+        return;
+    }
+    YCbCrToRGB(image, threadPool, image->pixels, stride);
+}
+
+// convert an MCU row and pass its pixels to the writer
+bool writeMCURow(JPGImage* const image, const uint32_t mcuRow, RowWriter* const writer) {
+    YCbCrToRGBMCURow(image, mcuRow, image->pixels, (size_t)image->outputWidth * getBytesPerPixel(image->pixelFormat));
+
+    uint32_t firstRow = 0;
+    uint32_t numRows = 0;
+    getOutputRows(image, mcuRow, 1, firstRow, numRows);
+    return numRows == 0 || writer->writeRows(image->pixels, firstRow, numRows);
+}
+
+// finish a decoded MCU row and pass its pixels to the writer
+// with vertical fancy upsampling the MCU row before it is written
+//   instead, now that the MCU rows on both sides of it are transformed,
+//   and the last MCU row right after it
+bool processMCURow(JPGImage* const image, const uint32_t mcuRow, RowWriter* const writer) {
+    inverseDCTMCURow(image, mcuRow);
+    if (!hasVerticalContext(image)) {
+        return writeMCURow(image, mcuRow, writer);
+    }
+    if (mcuRow > image->firstMCURow && !writeMCURow(image, mcuRow - 1, writer)) {
+        return false;
+    }
+    return mcuRow + 1 < image->endMCURow || writeMCURow(image, mcuRow, writer);
+}
+
+// decodes one JPG after another into the same image, whose buffers come
+//   from an arena, so that once an image at least as large as the next
+//   one has been decoded, decoding allocates nothing
+class Decoder {
+private:
+    Arena arena;
+    JPGImage image;
+
+public:
+    // decode a JPG held in memory, see readJPG, and also convert the pixels
+    //   that were not passed to writer into the image's pixels
+    // the image is valid until the next call
+    const JPGImage* decode(const byte* const data, const size_t size, RowWriter* const writer, ThreadPool* const threadPool, const DecodeOptions& options) {
+        image.reset();
+        arena.reset();
+        image.arena = &arena;
+
+        readJPG(&image, data, size, writer, threadPool, options);
+        if (image.isValid && (image.frameType != SOF0 || writer == nullptr)) {
+            // dequantize DCT coefficients and Inverse Discrete Cosine Transform
+            inverseDCT(&image, threadPool);
+
+            // color conversion
+            YCbCrToRGB(&image, threadPool);
+        }
+        return &image;
+    }
+};
+
 // helper function to write a 4-byte integer in little-endian
 void putInt(byte*& bufferPos, const uint32_t v) {
     *bufferPos++ = v >> 0;
@@ -1365,104 +3424,616 @@ void putShort(byte*& bufferPos, const uint32_t v) {
     *bufferPos++ = v >> 8;
 }
 
-// write all the pixels in the MCUs to a BMP file
-void writeBMP(const JPGImage* const image, const std::string& filename) {
-    // open file
-    std::cout << "Writing " << filename << "...\n";
-    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
-        return;
-    }
-
-    const uint32_t paddingSize = image->width % 4;
-    const uint32_t size = 14 + 12 + image->height * image->width * 3 + paddingSize * image->height;
-
-    byte* buffer = new (std::nothrow) byte[size];
-    if (buffer == nullptr) {
-        std::cout << "Error - Memory error\n";
-        outFile.close();
-        return;
-    }
-    byte* bufferPos = buffer;
+// helper function to write the 26-byte header of a 24-bit BMP file
+void putBMPHeader(byte*& bufferPos, const uint32_t width, const uint32_t height) {
+    const uint64_t size = 14 + 12 + (uint64_t)height * (width * 3 + width % 4);
 
     *bufferPos++ = 'B';
     *bufferPos++ = 'M';
-    putInt(bufferPos, size);
+    // the size field is informational and too small for the largest images
+    putInt(bufferPos, size <= 0xFFFFFFFF ? (uint32_t)size : 0);
     putInt(bufferPos, 0);
     putInt(bufferPos, 0x1A);
     putInt(bufferPos, 12);
-    putShort(bufferPos, image->width);
-    putShort(bufferPos, image->height);
+    putShort(bufferPos, width);
+    putShort(bufferPos, height);
     putShort(bufferPos, 1);
     putShort(bufferPos, 24);
+}
 
-    for (uint32_t y = image->height - 1; y < image->height; --y) {
-        const uint32_t blockRow = y / 8;
-        const uint32_t pixelRow = y % 8;
-        for (uint32_t x = 0; x < image->width; ++x) {
-            const uint32_t blockColumn = x / 8;
-            const uint32_t pixelColumn = x % 8;
-            const uint32_t blockIndex = blockRow * image->blockWidthReal + blockColumn;
-            const uint32_t pixelIndex = pixelRow * 8 + pixelColumn;
-            *bufferPos++ = image->blocks[blockIndex].b[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].g[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].r[pixelIndex];
+// helper function to write a row of pixels in any pixel format as a
+//   row of a 24-bit BMP file, which stores BGR, padded to 4 bytes
+void putBMPRow(byte*& bufferPos, const byte* pixelPos, const uint32_t width, const PixelFormat format) {
+    if (format == PixelFormat::BGR) {
+        bufferPos = std::copy(pixelPos, pixelPos + (size_t)width * 3, bufferPos);
+    }
+    else if (format == PixelFormat::GRAY) {
+        for (uint32_t x = 0; x < width; ++x) {
+            *bufferPos++ = *pixelPos;
+            *bufferPos++ = *pixelPos;
+            *bufferPos++ = *pixelPos++;
         }
-        for (uint32_t i = 0; i < paddingSize; ++i) {
-            *bufferPos++ = 0;
+    }
+    else {
+        const uint32_t bytesPerPixel = getBytesPerPixel(format);
+        for (uint32_t x = 0; x < width; ++x) {
+            *bufferPos++ = pixelPos[2];
+            *bufferPos++ = pixelPos[1];
+            *bufferPos++ = pixelPos[0];
+            pixelPos += bytesPerPixel;
         }
     }
-
-    outFile.write((char*)buffer, size);
-    outFile.close();
-    delete[] buffer;
+    for (uint32_t i = 0; i < width % 4; ++i) {
+        *bufferPos++ = 0;
+    }
 }
 
-int main(int argc, char** argv) {
-    // validate arguments
-    if (argc < 2) {
-        std::cout << "Error - Invalid arguments\n";
-        return 1;
+// writes a BMP file while the image is being decoded
+//   BMP rows are stored from the bottom up, so each batch of rows is
+//   written straight to its final place in the file
+//   rows go through a buffer of at most maxBufferSize bytes, or one row
+//   if that is larger, so the whole file is never held in memory
+class BMPWriter : public RowWriter {
+private:
+    const std::string filename;
+    std::ofstream outFile;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    PixelFormat pixelFormat = PixelFormat::RGB;
+
+public:
+    BMPWriter(const std::string& f) :
+        filename(f)
+    {
     }
 
-    for (int i = 1; i < argc; ++i) {
+    bool start(const JPGImage* const image) override {
+        logMessage(LogLevel::Info, "Writing ", filename, "...");
+        outFile.open(filename, std::ios::out | std::ios::binary);
+        if (!outFile.is_open()) {
+            logMessage(LogLevel::Error, "Error - Error opening output file");
+            return false;
+        }
+        width = image->outputWidth;
+        height = image->outputHeight;
+        pixelFormat = image->pixelFormat;
+
+        byte header[26];
+        byte* bufferPos = header;
+        putBMPHeader(bufferPos, width, height);
+        outFile.write((char*)header, sizeof(header));
+        return !!outFile;
+    }
+
+    bool writeRows(const byte* const rows, const uint32_t firstRow, const uint32_t numRows) override {
+        const size_t maxBufferSize = 1 << 20;
+        const uint32_t paddingSize = width % 4;
+        const size_t rowSize = (size_t)width * 3 + paddingSize;
+        const uint32_t batchRows = (uint32_t)std::max<size_t>(1, maxBufferSize / rowSize);
+        const size_t stride = (size_t)width * getBytesPerPixel(pixelFormat);
+        // shared by the writers of a thread, so decoding many files does
+        //   not allocate a buffer for each of them
+        thread_local std::vector<byte> buffer;
+
+        // the last rows come first in the file
+        for (uint32_t endRow = numRows; endRow > 0;) {
+            const uint32_t batchFirstRow = endRow - std::min(batchRows, endRow);
+            buffer.resize(rowSize * (endRow - batchFirstRow));
+            byte* bufferPos = buffer.data();
+            for (uint32_t y = endRow - 1; y + 1 > batchFirstRow; --y) {
+                putBMPRow(bufferPos, rows + y * stride, width, pixelFormat);
+            }
+
+            outFile.seekp(26 + (uint64_t)(height - firstRow - endRow) * rowSize);
+            outFile.write((char*)buffer.data(), buffer.size());
+            if (!outFile) {
+                logMessage(LogLevel::Error, "Error - Error writing output file");
+                return false;
+            }
+            endRow = batchFirstRow;
+        }
+        return true;
+    }
+
+    // close and delete the file, so an image that fails part way through
+    //   does not leave a partly written BMP behind
+    void discard() {
+        if (outFile.is_open()) {
+            outFile.close();
+            std::remove(filename.c_str());
+        }
+    }
+};
+
+// write all the pixels of an image to a BMP file
+// returns whether the file was written
+bool writeBMP(const JPGImage* const image, const std::string& filename) {
+    BMPWriter writer(filename);
+    if (!writer.start(image) || !writer.writeRows(image->pixels, 0, image->outputHeight)) {
+        writer.discard();
+        return false;
+    }
+    return true;
+}
+
+// read every file repeatedly with and without the Huffman lookup arrays
+//   and print the average time each way
+void benchmarkHuffmanDecoding(const int argc, char** const argv) {
+    const uint32_t iterations = 10;
+    double totalTimes[2] = { 0.0, 0.0 };
+
+    for (int i = 0; i < argc; ++i) {
         const std::string filename(argv[i]);
+        double times[2] = { 0.0, 0.0 };
+        DecodeError error = DecodeError::None;
+
+        for (uint32_t lookup = 0; lookup < 2; ++lookup) {
+            huffmanLookupEnabled = lookup == 1;
+            // silence the marker output while timing
+            const LogLevel level = logLevel;
+            logLevel = LogLevel::Silent;
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t j = 0; j < iterations; ++j) {
+                JPGImage* image = readJPG(filename, nullptr, nullptr, DecodeOptions());
+                error = image == nullptr ? DecodeError::OutOfMemory : image->error;
+                delete image;
+            }
+            const auto end = std::chrono::steady_clock::now();
+            logLevel = level;
+            times[lookup] = std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+        }
 
-        // read image
-        JPGImage* image = readJPG(filename);
-        // validate image
-        if (image == nullptr) {
+        // files that fail are left out of the totals
+        if (error != DecodeError::None) {
+            std::cout << "Error - Failed to decode " << filename << ": " << getErrorName(error) << '\n';
             continue;
         }
-        if (image->blocks == nullptr) {
-            delete image;
+        totalTimes[0] += times[0];
+        totalTimes[1] += times[1];
+
+        std::cout << filename << ": " << times[0] << " ms bit by bit, "
+            << times[1] << " ms with lookup (" << times[0] / times[1] << "x)\n";
+    }
+    huffmanLookupEnabled = true;
+
+    std::cout << "Total: " << totalTimes[0] << " ms bit by bit, "
+        << totalTimes[1] << " ms with lookup (" << totalTimes[0] / totalTimes[1] << "x)\n";
+}
+
+// run every IDCT kernel the CPU supports over the same random blocks,
+//   print its average time per block and how far it strays from the scalar kernel
+void benchmarkInverseDCT() {
+    const uint32_t numBlocks = 1 << 16;
+    const uint32_t iterations = 10;
+
+    // dequantized coefficients shrink with frequency in real images
+    QuantizationTable qTable;
+    for (uint32_t i = 0; i < 64; ++i) {
+        qTable.table[i] = 1 + (i % 8) + (i % 64) / 8;
+    }
+    scaleQuantizationTable(qTable);
+    std::vector<int16_t> input(numBlocks * 64);
+    std::mt19937 generator(1);
+    for (uint32_t i = 0; i < numBlocks * 64; ++i) {
+        const int range = 1024 / (1 + (i % 8) + (i % 64) / 8) / (int)qTable.table[i % 64];
+        input[i] = std::uniform_int_distribution<int>(-range, range)(generator);
+    }
+
+    std::vector<int16_t> expected(input);
+    for (uint32_t i = 0; i < numBlocks; ++i) {
+        inverseDCTBlockComponent(expected.data() + i * 64, qTable.scaledTable);
+    }
+
+    struct Kernel {
+        const char* name;
+        InverseDCTFunction function;
+        bool supported;
+    };
+    const Kernel kernels[] = {
+        { "scalar", inverseDCTBlockComponent, true },
+#ifdef JPG_X86
+        { "SSE2", inverseDCTBlockComponentSSE2, cpuSupportsSSE2() },
+        { "AVX2", inverseDCTBlockComponentAVX2, cpuSupportsAVX2() },
+#endif
+    };
+
+    for (const Kernel& kernel : kernels) {
+        if (!kernel.supported) {
+            std::cout << "IDCT " << kernel.name << ": not supported by this CPU\n";
+            continue;
+        }
+        std::vector<int16_t> output;
+        double time = 0.0;
+        for (uint32_t j = 0; j < iterations; ++j) {
+            output = input;
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < numBlocks; ++i) {
+                kernel.function(output.data() + i * 64, qTable.scaledTable);
+            }
+            const auto end = std::chrono::steady_clock::now();
+            time += std::chrono::duration<double, std::nano>(end - start).count();
+        }
+
+        int maxError = 0;
+        for (uint32_t i = 0; i < numBlocks * 64; ++i) {
+            maxError = std::max(maxError, std::abs(output[i] - expected[i]));
+        }
+        std::cout << "IDCT " << kernel.name << ": " << time / iterations / numBlocks << " ns per block, "
+            << (maxError == 0 ? "bit-exact" : "max error " + std::to_string(maxError))
+            << (kernel.function == inverseDCTBlockComponentBest ? " (in use)" : "") << '\n';
+    }
+
+    // blocks whose coefficients stop early take the sparse kernels,
+    //   compare them with the full kernel in use on the same blocks
+    struct SparseKernel {
+        const char* name;
+        InverseDCTFunction function;
+        bool supported;
+        byte lastNonzero;
+    };
+    const SparseKernel sparseKernels[] = {
+        { "DC only", inverseDCTBlockComponentDC, true, 0 },
+        { "4x4 scalar", inverseDCTBlockComponent4x4, true, 9 },
+#ifdef JPG_X86
+        { "4x4 SSE2", inverseDCTBlockComponent4x4SSE2, cpuSupportsSSE2(), 9 },
+        { "4x4 AVX2", inverseDCTBlockComponent4x4AVX2, cpuSupportsAVX2(), 9 },
+#endif
+    };
+
+    for (const SparseKernel& kernel : sparseKernels) {
+        if (!kernel.supported) {
+            std::cout << "IDCT " << kernel.name << ": not supported by this CPU\n";
             continue;
         }
-        if (image->isValid == false) {
-            delete[] image->blocks;
-            delete image;
+        std::vector<int16_t> sparseInput(input);
+        for (uint32_t i = 0; i < numBlocks; ++i) {
+            for (uint32_t j = kernel.lastNonzero + 1; j < 64; ++j) {
+                sparseInput[i * 64 + zigZagMap[j]] = 0;
+            }
+        }
+        std::vector<int16_t> sparseExpected(sparseInput);
+        for (uint32_t i = 0; i < numBlocks; ++i) {
+            inverseDCTBlockComponent(sparseExpected.data() + i * 64, qTable.scaledTable);
+        }
+
+        double times[2] = { 0.0, 0.0 };
+        const InverseDCTFunction functions[2] = { kernel.function, inverseDCTBlockComponentBest };
+        std::vector<int16_t> output;
+        for (uint32_t k = 0; k < 2; ++k) {
+            for (uint32_t j = 0; j < iterations; ++j) {
+                output = sparseInput;
+                const auto start = std::chrono::steady_clock::now();
+                for (uint32_t i = 0; i < numBlocks; ++i) {
+                    functions[k](output.data() + i * 64, qTable.scaledTable);
+                }
+                const auto end = std::chrono::steady_clock::now();
+                times[k] += std::chrono::duration<double, std::nano>(end - start).count();
+            }
+        }
+
+        // output holds the full kernel's results, check the sparse one's
+        output = sparseInput;
+        for (uint32_t i = 0; i < numBlocks; ++i) {
+            kernel.function(output.data() + i * 64, qTable.scaledTable);
+        }
+        int maxError = 0;
+        for (uint32_t i = 0; i < numBlocks * 64; ++i) {
+            maxError = std::max(maxError, std::abs(output[i] - sparseExpected[i]));
+        }
+        std::cout << "IDCT " << kernel.name << ": " << times[0] / iterations / numBlocks << " ns per block, "
+            << times[1] / iterations / numBlocks << " ns with the full kernel, "
+            << (maxError == 0 ? "bit-exact" : "max error " + std::to_string(maxError))
+            << (kernel.function == selectInverseDCT(kernel.lastNonzero) ? " (in use)" : "") << '\n';
+    }
+
+    // the integer kernels must match the scalar integer kernel exactly,
+    //   their error is measured against the float kernel
+    std::vector<int16_t> integerExpected(input);
+    for (uint32_t i = 0; i < numBlocks; ++i) {
+        inverseDCTBlockComponentInteger(integerExpected.data() + i * 64, qTable.integerTable);
+    }
+    int floatError = 0;
+    for (uint32_t i = 0; i < numBlocks * 64; ++i) {
+        floatError = std::max(floatError, std::abs(integerExpected[i] - expected[i]));
+    }
+
+    struct IntegerKernel {
+        const char* name;
+        IntegerInverseDCTFunction function;
+        bool supported;
+    };
+    const IntegerKernel integerKernels[] = {
+        { "integer scalar", inverseDCTBlockComponentInteger, true },
+#ifdef JPG_X86
+        { "integer SSE2", inverseDCTBlockComponentIntegerSSE2, cpuSupportsSSE2() },
+#endif
+    };
+
+    for (const IntegerKernel& kernel : integerKernels) {
+        if (!kernel.supported) {
+            std::cout << "IDCT " << kernel.name << ": not supported by this CPU\n";
             continue;
         }
+        std::vector<int16_t> output;
+        double time = 0.0;
+        for (uint32_t j = 0; j < iterations; ++j) {
+            output = input;
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < numBlocks; ++i) {
+                kernel.function(output.data() + i * 64, qTable.integerTable);
+            }
+            const auto end = std::chrono::steady_clock::now();
+            time += std::chrono::duration<double, std::nano>(end - start).count();
+        }
 
-        // dequantize DCT coefficients
-        dequantize(image);
+        int maxError = 0;
+        for (uint32_t i = 0; i < numBlocks * 64; ++i) {
+            maxError = std::max(maxError, std::abs(output[i] - integerExpected[i]));
+        }
+        std::cout << "IDCT " << kernel.name << ": " << time / iterations / numBlocks << " ns per block, "
+            << (maxError == 0 ? "bit-exact" : "max error " + std::to_string(maxError))
+            << ", max difference from float " << floatError
+            << (kernel.function == inverseDCTBlockComponentIntegerBest ? " (in use with -idct integer)" : "") << '\n';
+    }
+}
 
-        // Inverse Discrete Cosine Transform
-        inverseDCT(image);
+// run every color conversion kernel the CPU supports over the same
+//   random rows in every pixel format, print its average time per pixel
+//   and whether it matches the scalar kernel
+void benchmarkColorConversion() {
+    // odd, so that the kernels' leftover pixels are covered too
+    const uint32_t count = (1 << 16) + 7;
+    const uint32_t iterations = 100;
+
+    // samples beyond the usual range check the clamping
+    std::vector<int16_t> rows(count * 3);
+    std::mt19937 generator(1);
+    for (uint32_t i = 0; i < count * 3; ++i) {
+        rows[i] = std::uniform_int_distribution<int>(-300, 300)(generator);
+    }
+    const int16_t* const yRow = rows.data();
+    const int16_t* const cbRow = yRow + count;
+    const int16_t* const crRow = cbRow + count;
+
+    struct Kernel {
+        const char* name;
+        ColorConversionFunction function;
+        bool supported;
+    };
+    const Kernel kernels[] = {
+        { "scalar", YCbCrToRGBRow, true },
+#ifdef JPG_X86
+        { "SSE2", YCbCrToRGBRowSSE2, cpuSupportsSSE2() },
+#endif
+    };
+    struct Format {
+        const char* name;
+        PixelFormat format;
+    };
+    const Format formats[] = {
+        { "RGB", PixelFormat::RGB },
+        { "BGR", PixelFormat::BGR },
+        { "RGBA", PixelFormat::RGBA },
+        { "GRAY", PixelFormat::GRAY },
+    };
+
+    for (const Format& format : formats) {
+        std::vector<byte> expected(count * getBytesPerPixel(format.format));
+        YCbCrToRGBRow(yRow, cbRow, crRow, expected.data(), count, format.format);
+
+        for (const Kernel& kernel : kernels) {
+            if (!kernel.supported) {
+                std::cout << "Color conversion " << kernel.name << ": not supported by this CPU\n";
+                continue;
+            }
+            std::vector<byte> output(expected.size());
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t j = 0; j < iterations; ++j) {
+                kernel.function(yRow, cbRow, crRow, output.data(), count, format.format);
+            }
+            const auto end = std::chrono::steady_clock::now();
+            const double time = std::chrono::duration<double, std::nano>(end - start).count();
 
-        // color conversion
-        YCbCrToRGB(image);
+            std::cout << "Color conversion " << kernel.name << " " << format.name << ": "
+                << time / iterations / count << " ns per pixel, "
+                << (output == expected ? "bit-exact" : "mismatch")
+                << (kernel.function == YCbCrToRGBRowBest ? " (in use)" : "") << '\n';
+        }
+    }
+}
+
+// decode a JPG file with decoder and write it to a BMP file of the same
+//   name, adding the size of the JPG file to bytesRead
+// returns the first error met, if any
+DecodeError convertJPGToBMP(const std::string& filename, Decoder& decoder, ThreadPool* const threadPool, const DecodeOptions& options, uint64_t& bytesRead) {
+    const std::size_t pos = filename.find_last_of('.');
+    const std::string outFilename = (pos == std::string::npos) ?
+        (filename + ".bmp") :
+        (filename.substr(0, pos) + ".bmp");
+
+    logMessage(LogLevel::Info, "Reading ", filename, "...");
+    const MappedFile file(filename);
+    if (!file.isOpen()) {
+        logMessage(LogLevel::Error, "Error - Error opening input file");
+        return DecodeError::OpenFailed;
+    }
+    bytesRead += file.getSize();
+
+    // read image, baseline images are written to the BMP file
+    //   while they are decoded
+    BMPWriter bmpWriter(outFilename);
+    const JPGImage* const image = decoder.decode(file.getData(), file.getSize(), &bmpWriter, threadPool, options);
+    if (image->isValid == false) {
+        bmpWriter.discard();
+        return image->error;
+    }
+
+    // write BMP file
+    if (image->frameType != SOF0 && !writeBMP(image, outFilename)) {
+        return DecodeError::WriteFailed;
+    }
+    return image->error;
+}
 
-        // write BMP file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFilename = (pos == std::string::npos) ?
-            (filename + ".bmp") :
-            (filename.substr(0, pos) + ".bmp");
-        writeBMP(image, outFilename);
+// decode many files at once, each one on a single thread, and report
+//   the throughput
+// the files that fail are listed at the end with their errors, as are the
+//   files whose damaged Huffman data was decoded with blank blocks
+// returns whether every file was decoded without errors
+bool convertJPGsToBMPs(const std::vector<std::string>& filenames, ThreadPool& threadPool, const DecodeOptions& options) {
+    std::atomic<uint64_t> totalBytes(0);
+    std::mutex failedMutex;
+    std::vector<std::pair<std::string, DecodeError>> failed;
+
+    const auto start = std::chrono::steady_clock::now();
+    threadPool.parallelFor((uint32_t)filenames.size(), [&](const uint32_t i) {
+        // each thread reuses its decoder's memory for all its files
+        thread_local Decoder decoder;
+        uint64_t bytesRead = 0;
+        const DecodeError error = convertJPGToBMP(filenames[i], decoder, nullptr, options, bytesRead);
+        totalBytes += bytesRead;
+        if (error != DecodeError::None) {
+            std::lock_guard<std::mutex> lock(failedMutex);
+            failed.emplace_back(filenames[i], error);
+        }
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // corrupt files still have their BMP written, so they count as decoded
+    std::sort(failed.begin(), failed.end());
+    uint32_t numCorrupt = 0;
+    for (const auto& file : failed) {
+        if (file.second == DecodeError::CorruptData) {
+            std::cout << "Error - Decoded " << file.first << " with errors: " << getErrorName(file.second) << '\n';
+            ++numCorrupt;
+        }
+        else {
+            std::cout << "Error - Failed to decode " << file.first << ": " << getErrorName(file.second) << '\n';
+        }
+    }
+    const uint32_t numDecoded = (uint32_t)(filenames.size() - failed.size()) + numCorrupt;
+    std::cout << "Decoded " << numDecoded << " of " << filenames.size() << " images";
+    if (numCorrupt != 0) {
+        std::cout << " (" << numCorrupt << " with errors)";
+    }
+    std::cout << " using " << threadPool.getNumThreads() << " threads in " << seconds * 1000.0 << " ms\n";
+    std::cout << "  " << numDecoded / seconds << " images/s, "
+        << totalBytes / seconds / (1024.0 * 1024.0) << " MB/s of JPG data\n";
+    return failed.empty();
+}
 
-        delete[] image->blocks;
-        delete image;
+int main(int argc, char** argv) {
+    // validate arguments
+    if (argc < 2) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    if (std::string(argv[1]) == "-benchmark") {
+        benchmarkHuffmanDecoding(argc - 2, argv + 2);
+        benchmarkInverseDCT();
+        benchmarkColorConversion();
+        return 0;
+    }
+
+    // options come before the files
+    // -threads N sets the number of decoding threads, by default
+    //   one per hardware thread
+    // -scale N decodes the images at 1/N size, N being 1, 2, 4 or 8
+    // -crop X,Y,W,H only decodes a W x H rectangle of the scaled images
+    //   with its top left corner at (X, Y)
+    // -idct float or -idct integer selects the IDCT arithmetic, float
+    //   by default
+    // -upsampling simple or -upsampling fancy selects how subsampled
+    //   chrominance is upsampled, simple by default
+    // -batch LIST also decodes the files listed in LIST, one per line, or
+    //   in standard input if LIST is -, decoding one file per thread
+    // -log silent, error, info or debug sets how much is reported about
+    //   each file, debug by default and silent with -batch
+    // the exit status is 1 if any file failed to decode or was decoded
+    //   with errors
+    int firstFile = 1;
+    uint32_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    DecodeOptions options;
+    // BMP files store BGR, so their rows are copied without reordering
+    options.pixelFormat = PixelFormat::BGR;
+    std::string batchList;
+    const char* const logLevelNames[] = { "silent", "error", "info", "debug" };
+    bool logLevelGiven = false;
+    while (firstFile < argc && argv[firstFile][0] == '-') {
+        const std::string option(argv[firstFile]);
+        const char* const valueString = firstFile + 1 < argc ? argv[firstFile + 1] : "";
+        const int value = std::atoi(valueString);
+        const size_t logLevelIndex = std::find(std::begin(logLevelNames), std::end(logLevelNames), std::string(valueString)) - std::begin(logLevelNames);
+        if (option == "-threads" && value >= 1) {
+            numThreads = value;
+        }
+        else if (option == "-scale" && (value == 1 || value == 2 || value == 4 || value == 8)) {
+            options.scale = value;
+        }
+        else if (option == "-crop" &&
+            std::sscanf(valueString, "%u,%u,%u,%u", &options.crop.x, &options.crop.y, &options.crop.width, &options.crop.height) == 4) {
+            options.cropping = true;
+        }
+        else if (option == "-idct" && (std::string(valueString) == "float" || std::string(valueString) == "integer")) {
+            options.integerIDCT = std::string(valueString) == "integer";
+        }
+        else if (option == "-upsampling" && (std::string(valueString) == "simple" || std::string(valueString) == "fancy")) {
+            options.fancyUpsampling = std::string(valueString) == "fancy";
+        }
+        else if (option == "-batch" && valueString[0] != '\0') {
+            batchList = valueString;
+        }
+        else if (option == "-log" && logLevelIndex < 4) {
+            logLevel = (LogLevel)logLevelIndex;
+            logLevelGiven = true;
+        }
+        else {
+            std::cout << "Error - Invalid arguments\n";
+            return 1;
+        }
+        firstFile += 2;
+    }
+    std::vector<std::string> filenames(argv + firstFile, argv + argc);
+    if (!batchList.empty()) {
+        std::ifstream listFile;
+        if (batchList != "-") {
+            listFile.open(batchList);
+            if (!listFile.is_open()) {
+                std::cout << "Error - Error opening file list\n";
+                return 1;
+            }
+        }
+        std::istream& list = batchList == "-" ? std::cin : listFile;
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                filenames.push_back(line);
+            }
+        }
+    }
+    if (filenames.empty()) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+    ThreadPool threadPool(numThreads);
+
+    if (!batchList.empty()) {
+        if (!logLevelGiven) {
+            logLevel = LogLevel::Silent;
+        }
+        return convertJPGsToBMPs(filenames, threadPool, options) ? 0 : 1;
+    }
+    Decoder decoder;
+    uint64_t bytesRead = 0;
+    bool allDecoded = true;
+    for (const std::string& filename : filenames) {
+        if (convertJPGToBMP(filename, decoder, &threadPool, options, bytesRead) != DecodeError::None) {
+            allDecoded = false;
+        }
     }
-    return 0;
+    return allDecoded ? 0 : 1;
 }
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 
 #include "jpg.h"
 
@@ -18,8 +21,12 @@ uint32_t getShort(std::ifstream& inFile) {
         + (inFile.get() << 8);
 }
 
-BMPImage readBMP(const std::string& filename) {
+// read a BMP file into blocks laid out for MCUs of the given luminance
+//   sampling factors
+BMPImage readBMP(const std::string& filename, const byte horizontalSamplingFactor, const byte verticalSamplingFactor) {
     BMPImage image;
+    image.horizontalSamplingFactor = horizontalSamplingFactor;
+    image.verticalSamplingFactor = verticalSamplingFactor;
 
     // open file
     std::cout << "Reading " << filename << "...\n";
@@ -68,8 +75,10 @@ BMPImage readBMP(const std::string& filename) {
 
     image.blockHeight = (image.height + 7) / 8;
     image.blockWidth = (image.width + 7) / 8;
+    image.blockHeightReal = (image.blockHeight + verticalSamplingFactor - 1) / verticalSamplingFactor * verticalSamplingFactor;
+    image.blockWidthReal = (image.blockWidth + horizontalSamplingFactor - 1) / horizontalSamplingFactor * horizontalSamplingFactor;
 
-    image.blocks = new (std::nothrow) Block[image.blockHeight * image.blockWidth];
+    image.blocks = new (std::nothrow) Block[image.blockHeightReal * image.blockWidthReal];
     if (image.blocks == nullptr) {
         std::cout << "Error - Memory error\n";
         inFile.close();
@@ -84,7 +93,7 @@ BMPImage readBMP(const std::string& filename) {
         for (uint32_t x = 0; x < image.width; ++x) {
             const uint32_t blockColumn = x / 8;
             const uint32_t pixelColumn = x % 8;
-            const uint32_t blockIndex = blockRow * image.blockWidth + blockColumn;
+            const uint32_t blockIndex = blockRow * image.blockWidthReal + blockColumn;
             const uint32_t pixelIndex = pixelRow * 8 + pixelColumn;
             image.blocks[blockIndex].b[pixelIndex] = inFile.get();
             image.blocks[blockIndex].g[pixelIndex] = inFile.get();
@@ -124,11 +133,56 @@ void RGBToYCbCrBlock(Block& block) {
 void RGBToYCbCr(const BMPImage& image) {
     for (uint32_t y = 0; y < image.blockHeight; ++y) {
         for (uint32_t x = 0; x < image.blockWidth; ++x) {
-            RGBToYCbCrBlock(image.blocks[y * image.blockWidth + x]);
+            RGBToYCbCrBlock(image.blocks[y * image.blockWidthReal + x]);
         }
     }
 }
 
+// average the chrominance of each MCU's pixels down to one block, kept in
+//   the cb and cr of the MCU's first block
+// MCUs past the edges of the image reuse the pixels on the edges
+void downsampleChroma(const BMPImage& image) {
+    const uint32_t hSamp = image.horizontalSamplingFactor;
+    const uint32_t vSamp = image.verticalSamplingFactor;
+    if (hSamp == 1 && vSamp == 1) {
+        return;
+    }
+    // the number of pixels averaged is hSamp * vSamp, a power of 2
+    const uint32_t shift = (hSamp - 1) + (vSamp - 1);
+
+    for (uint32_t y = 0; y < image.blockHeightReal; y += vSamp) {
+        for (uint32_t x = 0; x < image.blockWidthReal; x += hSamp) {
+            int cb[64];
+            int cr[64];
+            for (uint32_t pixel = 0; pixel < 64; ++pixel) {
+                int cbSum = 0;
+                int crSum = 0;
+                for (uint32_t v = 0; v < vSamp; ++v) {
+                    for (uint32_t h = 0; h < hSamp; ++h) {
+                        const uint32_t row = std::min(y * 8 + pixel / 8 * vSamp + v, image.height - 1);
+                        const uint32_t column = std::min(x * 8 + pixel % 8 * hSamp + h, image.width - 1);
+                        const Block& block = image.blocks[row / 8 * image.blockWidthReal + column / 8];
+                        cbSum += block.cb[row % 8 * 8 + column % 8];
+                        crSum += block.cr[row % 8 * 8 + column % 8];
+                    }
+                }
+                // round to nearest, halves upwards
+                cb[pixel] = (cbSum + (1 << shift >> 1)) >> shift;
+                cr[pixel] = (crSum + (1 << shift >> 1)) >> shift;
+            }
+            Block& block = image.blocks[y * image.blockWidthReal + x];
+            std::copy(cb, cb + 64, block.cb);
+            std::copy(cr, cr + 64, block.cr);
+        }
+    }
+}
+
+// whether a block of the image holds component i, as the chrominance
+//   is only kept in the first block of each MCU
+inline bool holdsComponent(const BMPImage& image, const uint32_t y, const uint32_t x, const uint32_t i) {
+    return i == 0 || (y % image.verticalSamplingFactor == 0 && x % image.horizontalSamplingFactor == 0);
+}
+
 // perform 1-D FDCT on all columns and rows of a block component
 //   resulting in 2-D FDCT
 void forwardDCTBlockComponent(int* const component) {
@@ -286,59 +340,147 @@ void forwardDCTBlockComponent(int* const component) {
 
 // perform FDCT on all MCUs
 void forwardDCT(const BMPImage& image) {
-    for (uint32_t y = 0; y < image.blockHeight; ++y) {
-        for (uint32_t x = 0; x < image.blockWidth; ++x) {
+    for (uint32_t y = 0; y < image.blockHeightReal; ++y) {
+        for (uint32_t x = 0; x < image.blockWidthReal; ++x) {
             for (uint32_t i = 0; i < 3; ++i) {
-                forwardDCTBlockComponent(image.blocks[y * image.blockWidth + x][i]);
+                if (holdsComponent(image, y, x, i)) {
+                    forwardDCTBlockComponent(image.blocks[y * image.blockWidthReal + x][i]);
+                }
             }
         }
     }
 }
 
-// quantize a block component based on a quantization table
+// quantize a block component based on a quantization table, rounding
+//   to the nearest value symmetrically around zero as libjpeg does
 void quantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
     for (uint32_t i = 0; i < 64; ++i) {
-        component[i] /= (signed)qTable.table[i];
+        const int divisor = qTable.table[i];
+        const int half = divisor / 2;
+        if (component[i] < 0) {
+            component[i] = -((-component[i] + half) / divisor);
+        }
+        else {
+            component[i] = (component[i] + half) / divisor;
+        }
+    }
+}
+
+// quality used when none is given, the same as libjpeg's
+const uint32_t defaultQuality = 75;
+
+// derive the table for a quality from 1 to 100 from the table at
+//   quality 50, scaling it as libjpeg does, so quality 100 gives all 1s
+QuantizationTable makeQuantizationTable(const QuantizationTable& baseTable, const uint32_t quality) {
+    const uint32_t scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    QuantizationTable qTable;
+    for (uint32_t i = 0; i < 64; ++i) {
+        qTable.table[i] = std::min(std::max((baseTable.table[i] * scale + 50) / 100, 1u), 255u);
     }
+    qTable.set = true;
+    return qTable;
+}
+
+// set the quantization tables of an image for a quality from 1 to 100
+void setQuality(BMPImage& image, const uint32_t quality) {
+    image.quantizationTables[0] = makeQuantizationTable(qTableY50, quality);
+    image.quantizationTables[1] = makeQuantizationTable(qTableCbCr50, quality);
 }
 
 // quantize all MCUs
 void quantize(const BMPImage& image) {
-    for (uint32_t y = 0; y < image.blockHeight; ++y) {
-        for (uint32_t x = 0; x < image.blockWidth; ++x) {
+    for (uint32_t y = 0; y < image.blockHeightReal; ++y) {
+        for (uint32_t x = 0; x < image.blockWidthReal; ++x) {
             for (uint32_t i = 0; i < 3; ++i) {
-                quantizeBlockComponent(*qTables100[i], image.blocks[y * image.blockWidth + x][i]);
+                if (holdsComponent(image, y, x, i)) {
+                    quantizeBlockComponent(image.quantizationTables[i == 0 ? 0 : 1], image.blocks[y * image.blockWidthReal + x][i]);
+                }
             }
         }
     }
 }
 
+// collects bits in a 64-bit buffer and appends them to data 32 at a time,
+//   stuffing a 0x00 byte after every 0xFF byte
 class BitWriter {
 private:
-    byte nextBit = 0;
     std::vector<byte>& data;
+    // bytes of data written so far, the rest of data is room for more
+    size_t size = 0;
+    // the lowest bitCount bits are waiting to be written, oldest first
+    uint64_t bitBuffer = 0;
+    uint32_t bitCount = 0;
+
+    // make room for count more bytes after size
+    byte* reserve(const size_t count) {
+        if (size + count > data.size()) {
+            data.resize(std::max(data.size() * 2, size + count));
+        }
+        return data.data() + size;
+    }
+
+    void writeWord(const uint32_t word) {
+        byte* const out = reserve(8);
+        // no byte is 0xFF when no byte of ~word is 0, which is the common case
+        const uint32_t inverted = ~word;
+        if (((inverted - 0x01010101) & ~inverted & 0x80808080) == 0) {
+            out[0] = word >> 24;
+            out[1] = word >> 16;
+            out[2] = word >> 8;
+            out[3] = word >> 0;
+            size += 4;
+            return;
+        }
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            const byte b = word >> shift;
+            data[size++] = b;
+            if (b == 0xFF) {
+                data[size++] = 0;
+            }
+        }
+    }
 
 public:
-    BitWriter(std::vector<byte>& d) :
-        data(d)
+    // data is expected to grow by about expectedSize bytes
+    BitWriter(std::vector<byte>& d, const size_t expectedSize) :
+        data(d),
+        size(d.size())
     {
+        reserve(expectedSize);
     }
 
-    void writeBit(uint32_t bit) {
-        if (nextBit == 0) {
-            data.push_back(0);
-        }
-        data.back() |= (bit & 1) << (7 - nextBit);
-        nextBit = (nextBit + 1) % 8;
-        if (nextBit == 0 && data.back() == 0xFF) {
-            data.push_back(0);
+    // write the low length bits of bits, highest first, length being at most 32
+    void writeBits(const uint32_t bits, const uint32_t length) {
+        bitBuffer = bitBuffer << length | (bits & ((1ull << length) - 1));
+        bitCount += length;
+        if (bitCount >= 32) {
+            bitCount -= 32;
+            writeWord((uint32_t)(bitBuffer >> bitCount));
         }
     }
 
-    void writeBits(uint32_t bits, uint32_t length) {
-        for (uint32_t i = 1; i <= length; ++i) {
-            writeBit(bits >> (length - i));
+    // write a Huffman code followed by the extra bits of its coefficient
+    void writeCode(const uint32_t code, const uint32_t codeLength, const uint32_t extraBits, const uint32_t extraLength) {
+        writeBits(code << extraLength | (extraBits & ((1u << extraLength) - 1)), codeLength + extraLength);
+    }
+
+    // write the bits still in the buffer, padding the last byte with 0s,
+    //   and shrink data to the bytes written
+    void flush() {
+        byte* out = reserve(16);
+        for (; bitCount >= 8; bitCount -= 8) {
+            const byte b = (byte)(bitBuffer >> (bitCount - 8));
+            *out++ = b;
+            if (b == 0xFF) {
+                *out++ = 0;
+            }
+        }
+        if (bitCount > 0) {
+            *out++ = (byte)(bitBuffer << (8 - bitCount));
+            bitCount = 0;
         }
+        size = out - data.data();
+        data.resize(size);
     }
 };
 
@@ -376,12 +518,45 @@ bool getCode(const HuffmanTable& hTable, byte symbol, uint32_t& code, uint32_t&
     return false;
 }
 
+// code and code length of every symbol of a Huffman table, indexed by
+//   the symbol, a length of 0 meaning the symbol has no code
+struct HuffmanEncodeTable {
+    uint32_t codes[256] = { 0 };
+    byte codeLengths[256] = { 0 };
+    // the table the codes come from
+    const HuffmanTable* hTable = nullptr;
+};
+
+// fill an encode table from a Huffman table whose codes have been generated
+void generateEncodeTable(const HuffmanTable& hTable, HuffmanEncodeTable& encodeTable) {
+    for (uint32_t i = 0; i < 16; ++i) {
+        for (uint32_t j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            encodeTable.codes[hTable.symbols[j]] = hTable.codes[j];
+            encodeTable.codeLengths[hTable.symbols[j]] = i + 1;
+        }
+    }
+    encodeTable.hTable = &hTable;
+}
+
+// when false, getCode scans the Huffman table for every symbol instead of
+//   indexing the encode table (only used to benchmark the encode tables)
+bool huffmanEncodeTablesEnabled = true;
+
+bool getCode(const HuffmanEncodeTable& encodeTable, byte symbol, uint32_t& code, uint32_t& codeLength) {
+    if (!huffmanEncodeTablesEnabled) {
+        return getCode(*encodeTable.hTable, symbol, code, codeLength);
+    }
+    code = encodeTable.codes[symbol];
+    codeLength = encodeTable.codeLengths[symbol];
+    return codeLength != 0;
+}
+
 bool encodeBlockComponent(
     BitWriter& bitWriter,
     int* const component,
     int& previousDC,
-    const HuffmanTable& dcTable,
-    const HuffmanTable& acTable
+    const HuffmanEncodeTable& dcTable,
+    const HuffmanEncodeTable& acTable
 ) {
     // encode DC value
     int coeff = component[0] - previousDC;
@@ -402,8 +577,7 @@ bool encodeBlockComponent(
         std::cout << "Error - Invalid DC value\n";
         return false;
     }
-    bitWriter.writeBits(code, codeLength);
-    bitWriter.writeBits(coeff, coeffLength);
+    bitWriter.writeCode(code, codeLength, coeff, coeffLength);
 
     // encode AC values
     for (uint32_t i = 1; i < 64; ++i) {
@@ -449,20 +623,22 @@ bool encodeBlockComponent(
             std::cout << "Error - Invalid AC value\n";
             return false;
         }
-        bitWriter.writeBits(code, codeLength);
-        bitWriter.writeBits(coeff, coeffLength);
+        bitWriter.writeCode(code, codeLength, coeff, coeffLength);
     }
 
     return true;
 }
 
-// encode all the Huffman data from all MCUs
-std::vector<byte> encodeHuffmanData(const BMPImage& image) {
-    std::vector<byte> huffmanData;
-    BitWriter bitWriter(huffmanData);
+// encode all the Huffman data from all MCUs, appending it to huffmanData
+// returns false if a coefficient could not be encoded
+bool encodeHuffmanData(const BMPImage& image, std::vector<byte>& huffmanData) {
+    // room for about two bits per sample, grown if the image needs more
+    BitWriter bitWriter(huffmanData, (size_t)image.blockHeight * image.blockWidth * 3 * 16);
 
     int previousDCs[3] = { 0 };
 
+    HuffmanEncodeTable dcEncodeTables[3];
+    HuffmanEncodeTable acEncodeTables[3];
     for (uint32_t i = 0; i < 3; ++i) {
         if (!dcTables[i]->set) {
             generateCodes(*dcTables[i]);
@@ -472,149 +648,218 @@ std::vector<byte> encodeHuffmanData(const BMPImage& image) {
             generateCodes(*acTables[i]);
             acTables[i]->set = true;
         }
+        generateEncodeTable(*dcTables[i], dcEncodeTables[i]);
+        generateEncodeTable(*acTables[i], acEncodeTables[i]);
     }
 
-    for (uint32_t y = 0; y < image.blockHeight; ++y) {
-        for (uint32_t x = 0; x < image.blockWidth; ++x) {
+    // each MCU holds its luminance blocks row by row, then one block of
+    //   each chrominance component
+    const uint32_t hSamp = image.horizontalSamplingFactor;
+    const uint32_t vSamp = image.verticalSamplingFactor;
+    for (uint32_t y = 0; y < image.blockHeightReal; y += vSamp) {
+        for (uint32_t x = 0; x < image.blockWidthReal; x += hSamp) {
             for (uint32_t i = 0; i < 3; ++i) {
-                if (!encodeBlockComponent(
-                    bitWriter,
-                    image.blocks[y * image.blockWidth + x][i],
-                    previousDCs[i],
-                    *dcTables[i],
-                    *acTables[i])) {
-                    return std::vector<byte>();
+                const uint32_t vMax = i == 0 ? vSamp : 1;
+                const uint32_t hMax = i == 0 ? hSamp : 1;
+                for (uint32_t v = 0; v < vMax; ++v) {
+                    for (uint32_t h = 0; h < hMax; ++h) {
+                        if (!encodeBlockComponent(
+                            bitWriter,
+                            image.blocks[(y + v) * image.blockWidthReal + (x + h)][i],
+                            previousDCs[i],
+                            dcEncodeTables[i],
+                            acEncodeTables[i])) {
+                            return false;
+                        }
+                    }
                 }
             }
         }
     }
+    bitWriter.flush();
 
-    return huffmanData;
+    return true;
 }
 
-// helper function to write a 2-byte short integer in big-endian
-void putShort(std::ofstream& outFile, const uint32_t v) {
-    outFile.put((v >> 8) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
+// helper function to append a 2-byte short integer in big-endian
+void putShort(std::vector<byte>& out, const uint32_t v) {
+    out.push_back((v >> 8) & 0xFF);
+    out.push_back((v >> 0) & 0xFF);
 }
 
-void writeQuantizationTable(std::ofstream& outFile, byte tableID, const QuantizationTable& qTable) {
-    outFile.put(0xFF);
-    outFile.put(DQT);
-    putShort(outFile, 67);
-    outFile.put(tableID);
+void writeQuantizationTable(std::vector<byte>& out, byte tableID, const QuantizationTable& qTable) {
+    out.push_back(0xFF);
+    out.push_back(DQT);
+    putShort(out, 67);
+    out.push_back(tableID);
     for (uint32_t i = 0; i < 64; ++i) {
-        outFile.put(qTable.table[zigZagMap[i]]);
+        out.push_back(qTable.table[zigZagMap[i]]);
     }
 }
 
-void writeStartOfFrame(std::ofstream& outFile, const BMPImage& image) {
-    outFile.put(0xFF);
-    outFile.put(SOF0);
-    putShort(outFile, 17);
-    outFile.put(8);
-    putShort(outFile, image.height);
-    putShort(outFile, image.width);
-    outFile.put(3);
+void writeStartOfFrame(std::vector<byte>& out, const BMPImage& image) {
+    out.push_back(0xFF);
+    out.push_back(SOF0);
+    putShort(out, 17);
+    out.push_back(8);
+    putShort(out, image.height);
+    putShort(out, image.width);
+    out.push_back(3);
     for (uint32_t i = 1; i <= 3; ++i) {
-        outFile.put(i);
-        outFile.put(0x11);
-        outFile.put(i == 1 ? 0 : 1);
+        out.push_back(i);
+        out.push_back(i == 1 ? image.horizontalSamplingFactor << 4 | image.verticalSamplingFactor : 0x11);
+        out.push_back(i == 1 ? 0 : 1);
     }
 }
 
-void writeHuffmanTable(std::ofstream& outFile, byte acdc, byte tableID, const HuffmanTable& hTable) {
-    outFile.put(0xFF);
-    outFile.put(DHT);
-    putShort(outFile, 19 + hTable.offsets[16]);
-    outFile.put(acdc << 4 | tableID);
+void writeHuffmanTable(std::vector<byte>& out, byte acdc, byte tableID, const HuffmanTable& hTable) {
+    out.push_back(0xFF);
+    out.push_back(DHT);
+    putShort(out, 19 + hTable.offsets[16]);
+    out.push_back(acdc << 4 | tableID);
     for (uint32_t i = 0; i < 16; ++i) {
-        outFile.put(hTable.offsets[i + 1] - hTable.offsets[i]);
+        out.push_back(hTable.offsets[i + 1] - hTable.offsets[i]);
     }
     for (uint32_t i = 0; i < 16; ++i) {
         for (uint32_t j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            outFile.put(hTable.symbols[j]);
+            out.push_back(hTable.symbols[j]);
         }
     }
 }
 
-void writeStartOfScan(std::ofstream& outFile) {
-    outFile.put(0xFF);
-    outFile.put(SOS);
-    putShort(outFile, 12);
-    outFile.put(3);
+void writeStartOfScan(std::vector<byte>& out) {
+    out.push_back(0xFF);
+    out.push_back(SOS);
+    putShort(out, 12);
+    out.push_back(3);
     for (uint32_t i = 1; i <= 3; ++i) {
-        outFile.put(i);
-        outFile.put(i == 1 ? 0x00 : 0x11);
+        out.push_back(i);
+        out.push_back(i == 1 ? 0x00 : 0x11);
     }
-    outFile.put(0);
-    outFile.put(63);
-    outFile.put(0);
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
 }
 
-void writeAPP0(std::ofstream& outFile) {
-    outFile.put(0xFF);
-    outFile.put(APP0);
-    putShort(outFile, 16);
-    outFile.put('J');
-    outFile.put('F');
-    outFile.put('I');
-    outFile.put('F');
-    outFile.put(0);
-    outFile.put(1);
-    outFile.put(2);
-    outFile.put(0);
-    putShort(outFile, 100);
-    putShort(outFile, 100);
-    outFile.put(0);
-    outFile.put(0);
+void writeAPP0(std::vector<byte>& out) {
+    out.push_back(0xFF);
+    out.push_back(APP0);
+    putShort(out, 16);
+    out.push_back('J');
+    out.push_back('F');
+    out.push_back('I');
+    out.push_back('F');
+    out.push_back(0);
+    out.push_back(1);
+    out.push_back(2);
+    out.push_back(0);
+    putShort(out, 100);
+    putShort(out, 100);
+    out.push_back(0);
+    out.push_back(0);
 }
 
-void writeJPG(const BMPImage& image, const std::string& filename) {
-    std::vector<byte> huffmanData = encodeHuffmanData(image);
-    if (huffmanData.size() == 0) {
-        return;
-    }
-
-    // open file
-    std::cout << "Writing " << filename << "...\n";
-    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
-        return;
-    }
+// encode an image as a JPG into jpg, replacing its contents but reusing
+//   its memory, so encoding many images can share one buffer
+// the headers and the entropy-coded data end up in one contiguous block
+// returns false if the image could not be encoded
+bool encodeJPG(const BMPImage& image, std::vector<byte>& jpg) {
+    jpg.clear();
 
     // SOI
-    outFile.put(0xFF);
-    outFile.put(SOI);
+    jpg.push_back(0xFF);
+    jpg.push_back(SOI);
 
     // APP0
-    writeAPP0(outFile);
+    writeAPP0(jpg);
 
     // DQT
-    writeQuantizationTable(outFile, 0, qTableY100);
-    writeQuantizationTable(outFile, 1, qTableCbCr100);
+    writeQuantizationTable(jpg, 0, image.quantizationTables[0]);
+    writeQuantizationTable(jpg, 1, image.quantizationTables[1]);
 
     // SOF
-    writeStartOfFrame(outFile, image);
+    writeStartOfFrame(jpg, image);
 
     // DHT
-    writeHuffmanTable(outFile, 0, 0, hDCTableY);
-    writeHuffmanTable(outFile, 0, 1, hDCTableCbCr);
-    writeHuffmanTable(outFile, 1, 0, hACTableY);
-    writeHuffmanTable(outFile, 1, 1, hACTableCbCr);
+    writeHuffmanTable(jpg, 0, 0, hDCTableY);
+    writeHuffmanTable(jpg, 0, 1, hDCTableCbCr);
+    writeHuffmanTable(jpg, 1, 0, hACTableY);
+    writeHuffmanTable(jpg, 1, 1, hACTableCbCr);
 
     // SOS
-    writeStartOfScan(outFile);
+    writeStartOfScan(jpg);
 
     // ECS
-    outFile.write((char*)&huffmanData[0], huffmanData.size());
+    if (!encodeHuffmanData(image, jpg)) {
+        return false;
+    }
 
     // EOI
-    outFile.put(0xFF);
-    outFile.put(EOI);
+    jpg.push_back(0xFF);
+    jpg.push_back(EOI);
+    return true;
+}
+
+void writeJPG(const BMPImage& image, const std::string& filename) {
+    std::vector<byte> jpg;
+    if (!encodeJPG(image, jpg)) {
+        return;
+    }
+
+    // open file
+    std::cout << "Writing " << filename << "...\n";
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cout << "Error - Error opening output file\n";
+        return;
+    }
+
+    // the whole file in one write
+    outFile.write((char*)jpg.data(), jpg.size());
+    if (!outFile) {
+        std::cout << "Error - Error writing output file\n";
+    }
+}
+
+// encode the Huffman data of every file repeatedly with and without the
+//   encode tables and print the average time each way
+void benchmarkHuffmanEncoding(const int argc, char** const argv) {
+    const uint32_t iterations = 10;
+    double totalTimes[2] = { 0.0, 0.0 };
+
+    for (int i = 0; i < argc; ++i) {
+        const std::string filename(argv[i]);
+        BMPImage image = readBMP(filename, 1, 1);
+        if (image.blocks == nullptr) {
+            continue;
+        }
+        RGBToYCbCr(image);
+        forwardDCT(image);
+        setQuality(image, defaultQuality);
+        quantize(image);
+
+        std::vector<byte> huffmanData;
+        double times[2] = { 0.0, 0.0 };
+        for (uint32_t lookup = 0; lookup < 2; ++lookup) {
+            huffmanEncodeTablesEnabled = lookup == 1;
+            const auto start = std::chrono::steady_clock::now();
+            for (uint32_t j = 0; j < iterations; ++j) {
+                huffmanData.clear();
+                encodeHuffmanData(image, huffmanData);
+            }
+            const auto end = std::chrono::steady_clock::now();
+            times[lookup] = std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+            totalTimes[lookup] += times[lookup];
+        }
+        delete[] image.blocks;
+
+        std::cout << filename << ": " << times[0] << " ms scanning, "
+            << times[1] << " ms with encode tables (" << times[0] / times[1] << "x)\n";
+    }
+    huffmanEncodeTablesEnabled = true;
 
-    outFile.close();
+    std::cout << "Total: " << totalTimes[0] << " ms scanning, "
+        << totalTimes[1] << " ms with encode tables (" << totalTimes[0] / totalTimes[1] << "x)\n";
 }
 
 int main(int argc, char** argv) {
@@ -624,11 +869,47 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[1]) == "-benchmark") {
+        benchmarkHuffmanEncoding(argc - 2, argv + 2);
+        return 0;
+    }
+
+    // options come before the files
+    // -subsampling 444, 422 or 420 selects how the chrominance is
+    //   subsampled, 444 (not at all) by default
+    // -quality N sets the quality from 1 to 100, which scales the
+    //   quantization tables, 75 by default
+    int firstFile = 1;
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+    uint32_t quality = defaultQuality;
+    while (firstFile < argc && argv[firstFile][0] == '-') {
+        const std::string option(argv[firstFile]);
+        const std::string value(firstFile + 1 < argc ? argv[firstFile + 1] : "");
+        const int number = std::atoi(value.c_str());
+        if (option == "-subsampling" && (value == "444" || value == "422" || value == "420")) {
+            horizontalSamplingFactor = value == "444" ? 1 : 2;
+            verticalSamplingFactor = value == "420" ? 2 : 1;
+        }
+        else if (option == "-quality" && number >= 1 && number <= 100) {
+            quality = number;
+        }
+        else {
+            std::cout << "Error - Invalid arguments\n";
+            return 1;
+        }
+        firstFile += 2;
+    }
+    if (firstFile >= argc) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    for (int i = firstFile; i < argc; ++i) {
         const std::string filename(argv[i]);
 
         // read image
-        BMPImage image = readBMP(filename);
+        BMPImage image = readBMP(filename, horizontalSamplingFactor, verticalSamplingFactor);
         // validate image
         if (image.blocks == nullptr) {
             continue;
@@ -637,10 +918,14 @@ int main(int argc, char** argv) {
         // color conversion
         RGBToYCbCr(image);
 
+        // chrominance subsampling
+        downsampleChroma(image);
+
         // Forward Discrete Cosine Transform
         forwardDCT(image);
 
         // quantize DCT coefficients
+        setQuality(image, quality);
         quantize(image);
 
         // write JPG file
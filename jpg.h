@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -98,6 +99,10 @@ const byte TEM = 0x01;
 struct QuantizationTable {
 	uint32_t table[64] = { 0 };
 	bool set = false;
+	// table pre-multiplied by the IDCT scale factors, used by the decoder
+	float scaledTable[64] = { 0 };
+	// table as 16-bit values, used by the decoder's integer IDCT
+	int16_t integerTable[64] = { 0 };
 };
 
 struct ColorComponent {
@@ -108,13 +113,87 @@ struct ColorComponent {
 	byte huffmanACTableID = 0;
 	bool usedInFrame = false;
 	bool usedInScan = false;
+
+	// this component's 8x8 blocks stored row by row, 64 values per block
+	//   holding DCT coefficients until the IDCT and samples after it
+	int16_t* blocks = nullptr;
+	// zig-zag index of the last coefficient that may be nonzero in each block
+	byte* lastNonzero = nullptr;
+	uint32_t blockHeight = 0;
+	uint32_t blockWidth = 0;
+	// the plane holds block rows firstBlockRow to endBlockRow - 1, wrapping
+	//   around when it has fewer rows, and blockWidth block columns
+	//   starting at firstBlockColumn
+	uint32_t firstBlockRow = 0;
+	uint32_t endBlockRow = 0;
+	uint32_t firstBlockColumn = 0;
+};
+
+// a rectangle of pixels
+struct CropRect {
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+};
+
+// layouts of decoded pixels, one byte per channel
+enum class PixelFormat : byte {
+	RGB,
+	BGR,
+	RGBA, // alpha is always 255
+	GRAY  // luminance only
+};
+
+// why decoding an image failed
+enum class DecodeError : byte {
+	None,
+	OpenFailed,    // the input file could not be opened
+	OutOfMemory,
+	InvalidOption, // the scale or crop rectangle is out of range
+	InvalidMarker, // a marker is malformed, out of place or unknown
+	Unsupported,   // the file is valid but uses a feature that is not supported
+	TruncatedFile, // the file ends before the image does
+	CorruptData,   // the Huffman data is damaged
+	WriteFailed    // the row writer did not take the pixels
+};
+
+// how much the decoder reports, each level including the ones before it
+enum class LogLevel : byte {
+	Silent,
+	Error, // why decoding failed
+	Info,  // the markers read and the files written
+	Debug  // the contents of the headers and tables
+};
+
+// how the decoder produces the pixels
+struct DecodeOptions {
+	// decode at 1/scale of the full size, scale being 1, 2, 4 or 8
+	uint32_t scale = 1;
+	// only decode the pixels inside crop, in pixels of the scaled image
+	bool cropping = false;
+	CropRect crop;
+	// transform full size blocks with fixed-point instead of float math
+	bool integerIDCT = false;
+	// interpolate subsampled chrominance between samples instead of
+	//   repeating each sample
+	bool fancyUpsampling = false;
+	PixelFormat pixelFormat = PixelFormat::RGB;
 };
 
+// number of bits used to index a Huffman table's fast lookup arrays
+const uint32_t huffmanLookupBits = 9;
+
 struct HuffmanTable {
 	byte offsets[17] = { 0 };
 	byte symbols[176] = { 0 };
 	uint32_t codes[176] = { 0 };
 	bool set = false;
+
+	// symbol and code length for every possible huffmanLookupBits-bit prefix
+	//   a length of 0 means the code is longer than huffmanLookupBits
+	byte lookupSymbols[1 << huffmanLookupBits] = { 0 };
+	byte lookupLengths[1 << huffmanLookupBits] = { 0 };
 };
 
 struct Block {
@@ -147,6 +226,8 @@ struct Block {
 	}
 };
 
+class Arena;
+
 struct JPGImage {
 	QuantizationTable quantizationTables[4];
 	HuffmanTable huffmanDCTables[4];
@@ -167,9 +248,39 @@ struct JPGImage {
 
 	uint32_t restartInterval = 0;
 
-	Block* blocks = nullptr;
+	// the pixels are decoded at 1/scale of the frame size, scale being 1, 2, 4 or 8
+	byte scale = 1;
+	// full size blocks are transformed with fixed-point instead of float math
+	bool integerIDCT = false;
+	// subsampled chrominance is interpolated, which needs the MCUs around
+	//   each converted MCU
+	bool fancyUpsampling = false;
+	// the pixels cover outputWidth x outputHeight pixels of the scaled
+	//   image starting at (outputX, outputY)
+	uint32_t outputX = 0;
+	uint32_t outputY = 0;
+	uint32_t outputWidth = 0;
+	uint32_t outputHeight = 0;
+	// only the MCUs that overlap the output, and with fancy upsampling
+	//   the MCUs next to them, are transformed and converted
+	uint32_t firstMCURow = 0;
+	uint32_t endMCURow = 0;
+	uint32_t firstMCUColumn = 0;
+	uint32_t endMCUColumn = 0;
+
+	// pixels stored row by row from the top in pixelFormat, with no gaps
+	//   between rows
+	PixelFormat pixelFormat = PixelFormat::RGB;
+	byte* pixels = nullptr;
+
+	// the buffers come from arena instead of the heap, if it is not null
+	Arena* arena = nullptr;
 
 	bool isValid = true;
+	// the first error that made the image invalid, or CorruptData for an
+	//   image that is still valid but whose blocks after damaged Huffman
+	//   data were left blank
+	DecodeError error = DecodeError::None;
 
 	uint32_t blockHeight = 0;
 	uint32_t blockWidth = 0;
@@ -178,6 +289,84 @@ struct JPGImage {
 
 	byte horizontalSamplingFactor = 1;
 	byte verticalSamplingFactor = 1;
+
+	JPGImage() = default;
+	// the image owns its buffers, so it cannot be copied
+	JPGImage(const JPGImage&) = delete;
+	JPGImage& operator=(const JPGImage&) = delete;
+
+	// free the buffers and return the image to its default state, so it
+	//   can be decoded into again
+	void reset() {
+		freeBuffers();
+		for (uint32_t i = 0; i < 4; ++i) {
+			quantizationTables[i] = QuantizationTable();
+			huffmanDCTables[i] = HuffmanTable();
+			huffmanACTables[i] = HuffmanTable();
+		}
+		for (uint32_t i = 0; i < 3; ++i) {
+			colorComponents[i] = ColorComponent();
+		}
+
+		frameType = 0;
+		width = 0;
+		height = 0;
+		numComponents = 0;
+		zeroBased = false;
+
+		componentsInScan = 0;
+		startOfSelection = 0;
+		endOfSelection = 63;
+		successiveApproximationHigh = 0;
+		successiveApproximationLow = 0;
+
+		restartInterval = 0;
+
+		scale = 1;
+		integerIDCT = false;
+		fancyUpsampling = false;
+		outputX = 0;
+		outputY = 0;
+		outputWidth = 0;
+		outputHeight = 0;
+		firstMCURow = 0;
+		endMCURow = 0;
+		firstMCUColumn = 0;
+		endMCUColumn = 0;
+
+		pixelFormat = PixelFormat::RGB;
+		pixels = nullptr;
+
+		arena = nullptr;
+
+		isValid = true;
+		error = DecodeError::None;
+
+		blockHeight = 0;
+		blockWidth = 0;
+		blockHeightReal = 0;
+		blockWidthReal = 0;
+
+		horizontalSamplingFactor = 1;
+		verticalSamplingFactor = 1;
+	}
+
+	~JPGImage() {
+		freeBuffers();
+	}
+
+private:
+	void freeBuffers() {
+		// buffers from an arena are freed with it
+		if (arena != nullptr) {
+			return;
+		}
+		for (uint32_t i = 0; i < 3; ++i) {
+			delete[] colorComponents[i].blocks;
+			delete[] colorComponents[i].lastNonzero;
+		}
+		delete[] pixels;
+	}
 };
 
 struct BMPImage {
@@ -188,6 +377,18 @@ struct BMPImage {
 
 	uint32_t blockHeight = 0;
 	uint32_t blockWidth = 0;
+	// the blocks cover whole MCUs, blockWidthReal blocks per row
+	uint32_t blockHeightReal = 0;
+	uint32_t blockWidthReal = 0;
+
+	// sampling factors of the luminance, the chrominance is sampled once
+	//   per MCU, in the cb and cr of the MCU's first block
+	byte horizontalSamplingFactor = 1;
+	byte verticalSamplingFactor = 1;
+
+	// luminance and chrominance tables, used both to quantize the
+	//   coefficients and in the DQT markers
+	QuantizationTable quantizationTables[2];
 };
 
 const float m0 = 2.0 * std::cos(1.0 / 16.0 * 2.0 * M_PI);
@@ -219,6 +420,8 @@ const byte zigZagMap[] = {
 
 // standard tables
 
+// the quantization tables at quality 50, which the encoder scales for
+//   other qualities
 const QuantizationTable qTableY50 = {
     {
         16,  11,  10,  16,  24,  40,  51,  61,
@@ -247,66 +450,6 @@ const QuantizationTable qTableCbCr50 = {
     true
 };
 
-const QuantizationTable qTableY75 = {
-    {
-        16 / 2,  11 / 2,  10 / 2,  16 / 2,  24 / 2,  40 / 2,  51 / 2,  61 / 2,
-        12 / 2,  12 / 2,  14 / 2,  19 / 2,  26 / 2,  58 / 2,  60 / 2,  55 / 2,
-        14 / 2,  13 / 2,  16 / 2,  24 / 2,  40 / 2,  57 / 2,  69 / 2,  56 / 2,
-        14 / 2,  17 / 2,  22 / 2,  29 / 2,  51 / 2,  87 / 2,  80 / 2,  62 / 2,
-        18 / 2,  22 / 2,  37 / 2,  56 / 2,  68 / 2, 109 / 2, 103 / 2,  77 / 2,
-        24 / 2,  35 / 2,  55 / 2,  64 / 2,  81 / 2, 104 / 2, 113 / 2,  92 / 2,
-        49 / 2,  64 / 2,  78 / 2,  87 / 2, 103 / 2, 121 / 2, 120 / 2, 101 / 2,
-        72 / 2,  92 / 2,  95 / 2,  98 / 2, 112 / 2, 100 / 2, 103 / 2,  99 / 2
-    },
-    true
-};
-
-const QuantizationTable qTableCbCr75 = {
-    {
-        17 / 2, 18 / 2, 24 / 2, 47 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        18 / 2, 21 / 2, 26 / 2, 66 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        24 / 2, 26 / 2, 56 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        47 / 2, 66 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2,
-        99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2, 99 / 2
-    },
-    true
-};
-
-const QuantizationTable qTableY100 = {
-    {
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1
-    },
-    true
-};
-
-const QuantizationTable qTableCbCr100 = {
-    {
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1
-    },
-    true
-};
-
-const QuantizationTable* const qTables50[] = { &qTableY50,  &qTableCbCr50,  &qTableCbCr50 };
-const QuantizationTable* const qTables75[] = { &qTableY75,  &qTableCbCr75,  &qTableCbCr75 };
-const QuantizationTable* const qTables100[] = { &qTableY100, &qTableCbCr100, &qTableCbCr100 };
-
 HuffmanTable hDCTableY = {
     { 0, 0, 1, 6, 7, 8, 9, 10, 11, 12, 12, 12, 12, 12, 12, 12, 12 },
     { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b },